@@ -1,6 +1,10 @@
 #include "flashlog.h"
+#include "record.h"
+#include "seqlock.h"
 #include "../include/utils/utils.h"
 #include "../include/crc/crc.h"
+#include "../include/codec/rle.h"
+#include "../include/codec/patch.h"
 #include "../include/debug/debug.h"
 
 #include <stddef.h>
@@ -18,21 +22,33 @@ void reset_header(record_header *header) {
     memset(header, 0, header_size);
 }
 
+uint32_t compute_header_crc(const record_header *header) {
+    return crc32_byte((const uint8_t*)header, offsetof(record_header, header_crc));
+}
+
 int is_valid_header(const record_header *header) {
     // some quick checks
     if (header->content_length > max_content_length) return 0;
     if (header->content_length == 0) {return 0;}
-    if (header->magic == HEADER_MAGIC) {
-        //if (header->header_crc == crc32_byte((uint8_t*)header, header_size)) {
-            return 1;
-        //}
-    }
-    return 0;
+    if (header->magic != HEADER_MAGIC) {return 0;}
+    if (!integrity_is_known(header->flags & FLAG_INTEGRITY_MASK)) {return 0;}
+    if (((header->flags & FLAG_CODEC_MASK) >> FLAG_CODEC_SHIFT) >= CODEC_COUNT) {return 0;}
+    
+    return header->header_crc == compute_header_crc(header);
 }
 
 // A helper function that returns the content length + the header size and the commit signature size
 uint32_t get_total_record_size(uint32_t content_length) {
-    return content_length + header_size + sizeof(uint32_t); // content + header + commit message
+    return round_up(header_size + content_length, FLASH_ALIGN) + sizeof(uint32_t); // header + content + padding + commit message
+}
+
+uint32_t record_codec_of(const record_header *header) {
+    return (header->flags & FLAG_CODEC_MASK) >> FLAG_CODEC_SHIFT;
+}
+
+// deltas can only be decoded on top of the record before them, everything else is a keyframe
+int is_delta_codec(uint32_t codec) {
+    return codec == CODEC_DELTA_RLE || codec == CODEC_PATCH;
 }
 
 record_state is_valid_record(uint32_t address) {
@@ -45,26 +61,30 @@ record_state is_valid_record(uint32_t address) {
     
     if (header.content_length > max_content_length) {return RECORD_HEADER_BOUNDS;}
     
-    // check content crc
-    size_t content_bytes_left = header.content_length;
-    uint32_t crc = start_crc;
-    uint32_t reading_address = address + header_size;
-    
-    uint8_t bytes[CRC_CHUNK];
+    // check content crc with whatever algorithm the record was written with
+    uint32_t kind = header.flags & FLAG_INTEGRITY_MASK;
     
-    while (content_bytes_left > 0) {
-        size_t read_bytes = min(content_bytes_left, CRC_CHUNK);
+    if (kind != INTEGRITY_HEADER_ONLY) {
+        size_t content_bytes_left = header.content_length;
+        uint32_t crc = integrity_start(kind);
+        uint32_t reading_address = address + header_size;
         
-        if (g_flash_hal.read(reading_address, bytes, read_bytes) != ERR_SUCCESS) {return RECORD_READ_ERROR;}
+        uint8_t bytes[CRC_CHUNK];
         
-        crc = crc32_byte_seq(crc, bytes, read_bytes);
-        content_bytes_left -= read_bytes;
-        reading_address += read_bytes;
+        while (content_bytes_left > 0) {
+            size_t read_bytes = min(content_bytes_left, CRC_CHUNK);
+            
+            if (g_flash_hal.read(reading_address, bytes, read_bytes) != ERR_SUCCESS) {return RECORD_READ_ERROR;}
+            
+            crc = integrity_update(kind, crc, bytes, read_bytes);
+            content_bytes_left -= read_bytes;
+            reading_address += read_bytes;
+        }
+        
+        crc = integrity_finalize(kind, crc);
+        if (crc != header.content_crc) {return RECORD_CRC_INVALID;}
     }
     
-    crc = crc32_finalize(crc);
-    if (crc != header.content_crc) {return RECORD_CRC_INVALID;}
-    
     uint32_t commit = 0;
     if (g_flash_hal.read(round_up(address + header_size + header.content_length, FLASH_ALIGN), &commit, sizeof(uint32_t)) != ERR_SUCCESS) {return RECORD_READ_ERROR;}
     if (commit != COMMIT_MAGIC) {return RECORD_INVALID_COMMIT;}
@@ -72,8 +92,291 @@ record_state is_valid_record(uint32_t address) {
     return RECORD_VALID;
 }
 
+flash_error flashlog_attach_write_buffer(FlashlogState *state, void *page, uint32_t size) {
+    if (state == NULL || page == NULL) {return ERR_NULL_PTR;}
+    if (size == 0 || size % FLASH_ALIGN != 0 || SECTOR_SIZE % size != 0) {return ERR_INVALID_ALIGN;}
+    
+    state->page_buffer = (uint8_t*)page;
+    state->page_size = size;
+    state->page_active = 0;
+    return ERR_SUCCESS;
+}
+
+// programs the part of the page buffer that hasn't reached the HAL yet
+flash_error flush_page(FlashlogState *state) {
+    if (!state->page_active || state->page_flushed == state->page_fill) {return ERR_SUCCESS;}
+    
+    flash_error error = g_flash_hal.write(state->page_addr + state->page_flushed, state->page_buffer + state->page_flushed, state->page_fill - state->page_flushed);
+    if (error != ERR_SUCCESS) {
+        debug_print("Error flushing page at %u: %i\n", state->page_addr, error);
+        return error;
+    }
+    
+    state->page_flushed = state->page_fill;
+    return ERR_SUCCESS;
+}
+
+static flash_error buffer_program(FlashlogState *state, uint32_t addr, const void *ptr, uint32_t len) {
+    const uint8_t *bytes = (const uint8_t*)ptr;
+    
+    while (len > 0) {
+        // anything outside the current page, or behind what is already buffered, starts a new one.
+        // the bytes in front of addr in that page are already on flash
+        if (!state->page_active || addr < state->page_addr + state->page_fill || addr >= state->page_addr + state->page_size) {
+            flash_error error = flush_page(state);
+            if (error != ERR_SUCCESS) {return error;}
+            
+            state->page_addr = round_down(addr, state->page_size);
+            state->page_fill = addr - state->page_addr;
+            state->page_flushed = state->page_fill;
+            state->page_active = 1;
+        }
+        
+        // alignment padding in front of the commit word reads back as erased, same as the HAL pads it
+        while (state->page_addr + state->page_fill < addr) {state->page_buffer[state->page_fill++] = 0xFF;}
+        
+        uint32_t offset = addr - state->page_addr;
+        uint32_t count = min(len, state->page_size - offset);
+        
+        memcpy(state->page_buffer + offset, bytes, count);
+        state->page_fill = offset + count;
+        
+        addr += count;
+        bytes += count;
+        len -= count;
+        
+        if (state->page_fill == state->page_size) {
+            flash_error error = flush_page(state);
+            if (error != ERR_SUCCESS) {return error;}
+        }
+    }
+    
+    return ERR_SUCCESS;
+}
+
+// every program the log does goes through here. with a write buffer attached the bytes are
+// gathered per page and only handed to the HAL once the page is full or a flush asks for it
+static flash_error log_program(FlashlogState *state, uint32_t addr, const void *ptr, uint32_t len) {
+    if (state->page_buffer == NULL) {return g_flash_hal.write(addr, ptr, len);}
+    
+    // recycling the page rewrites bytes concurrent readers may be looking at
+    seqlock_write_begin(&state->publish_seq);
+    flash_error error = buffer_program(state, addr, ptr, len);
+    seqlock_write_end(&state->publish_seq);
+    
+    return error;
+}
+
+// reads through the write buffer so records that haven't been programmed yet are still visible
+flash_error log_read(FlashlogState *state, uint32_t addr, void *ptr, uint32_t len) {
+    flash_error error = g_flash_hal.read(addr, ptr, len);
+    if (error != ERR_SUCCESS || state->page_buffer == NULL || !state->page_active) {return error;}
+    
+    // load every field once, a concurrent reader can see a page that is being recycled. the
+    // seqlock throws the result away afterwards but the copy itself has to stay in bounds
+    uint32_t page_addr = state->page_addr;
+    uint32_t flushed = state->page_flushed;
+    uint32_t fill = state->page_fill;
+    if (flushed > fill || fill > state->page_size) {return error;}
+    
+    uint32_t start = max(addr, page_addr + flushed);
+    uint32_t end = min(addr + len, page_addr + fill);
+    
+    if (start < end) {
+        memcpy((uint8_t*)ptr + (start - addr), state->page_buffer + (start - page_addr), end - start);
+    }
+    
+    return error;
+}
+
+flash_error flashlog_attach_mirror(FlashlogState *state, void *buffer, uint32_t capacity) {
+    if (state == NULL || buffer == NULL) {return ERR_NULL_PTR;}
+    if (capacity == 0) {return ERR_INVALID_ARGUMENT;}
+    
+    state->mirror = (uint8_t*)buffer;
+    state->mirror_capacity = capacity;
+    state->mirror_length = 0;
+    state->mirror_valid = 0;
+    return ERR_SUCCESS;
+}
+
+// applies the patches of the record at address on top of dst. the entries are read straight
+// into place so no scratch buffer is needed
+static int apply_patch(FlashlogState *state, uint32_t address, const record_header *header, uint8_t *dst, uint32_t length, uint32_t base_sequence) {
+    uint32_t reading_address = address + header_size;
+    uint32_t end = reading_address + header->content_length;
+    
+    uint8_t prefix[PATCH_PREFIX_SIZE];
+    if (header->content_length < PATCH_PREFIX_SIZE) {return 0;}
+    if (log_read(state, reading_address, prefix, PATCH_PREFIX_SIZE) != ERR_SUCCESS) {return 0;}
+    
+    uint32_t patch_base = prefix[0] | (prefix[1] << 8) | (prefix[2] << 16) | ((uint32_t)prefix[3] << 24);
+    if (patch_base != base_sequence) {
+        debug_print("Patch at %u is based on %u, expected %u\n", address, patch_base, base_sequence);
+        return 0;
+    }
+    reading_address += PATCH_PREFIX_SIZE;
+    
+    while (reading_address < end) {
+        uint8_t entry[PATCH_ENTRY_HEADER];
+        if (end - reading_address < PATCH_ENTRY_HEADER) {return 0;}
+        if (log_read(state, reading_address, entry, PATCH_ENTRY_HEADER) != ERR_SUCCESS) {return 0;}
+        reading_address += PATCH_ENTRY_HEADER;
+        
+        uint32_t offset = entry[0] | (entry[1] << 8);
+        uint32_t count = entry[2] | (entry[3] << 8);
+        if (count == 0 || offset + count > length || count > end - reading_address) {return 0;}
+        
+        if (log_read(state, reading_address, dst + offset, count) != ERR_SUCCESS) {return 0;}
+        reading_address += count;
+    }
+    
+    return 1;
+}
+
+// decodes the payload of the record at address into dst. keyframes replace the contents,
+// deltas are applied on top of the previous record which has to be in dst already (have_base),
+// patches also have to point at base_sequence. returns 1 and sets length on success
+int decode_record(FlashlogState *state, uint32_t address, const record_header *header, uint8_t *dst, uint32_t capacity, uint32_t *length, int have_base, uint32_t base_sequence) {
+    uint32_t codec = record_codec_of(header);
+    
+    if (codec == CODEC_PATCH) {
+        if (!have_base) {return 0;}
+        return apply_patch(state, address, header, dst, *length, base_sequence);
+    }
+    
+    if (codec == CODEC_RAW) {
+        if (header->content_length > capacity) {
+            debug_print("Record (%u bytes) doesn't fit the buffer (%u bytes)\n", header->content_length, capacity);
+            return 0;
+        }
+        if (log_read(state, address + header_size, dst, header->content_length) != ERR_SUCCESS) {return 0;}
+        *length = header->content_length;
+        return 1;
+    }
+    
+    rle_decoder decoder;
+    if (codec == CODEC_DELTA_RLE) {
+        if (!have_base) {return 0;}
+        rle_decoder_init(&decoder, dst, *length, 1);
+    } else {
+        rle_decoder_init(&decoder, dst, capacity, 0);
+    }
+    
+    uint32_t bytes_left = header->content_length;
+    uint32_t reading_address = address + header_size;
+    uint8_t bytes[CRC_CHUNK];
+    
+    while (bytes_left > 0) {
+        uint32_t read_bytes = min(bytes_left, CRC_CHUNK);
+        if (log_read(state, reading_address, bytes, read_bytes) != ERR_SUCCESS) {return 0;}
+        if (rle_decoder_feed(&decoder, bytes, read_bytes) != 0) {return 0;}
+        bytes_left -= read_bytes;
+        reading_address += read_bytes;
+    }
+    
+    if (!rle_decoder_done(&decoder)) {return 0;}
+    if (codec == CODEC_DELTA_RLE && decoder.length != *length) {return 0;}
+    
+    *length = decoder.length;
+    return 1;
+}
+
+// replays the records from the keyframe at address up to last_record_addr into the mirror,
+// only used at mount. the narrow scan already validated every record in between
+static void rebuild_mirror(FlashlogState *state, uint32_t address) {
+    state->mirror_valid = 0;
+    state->since_keyframe = 0;
+    if (state->mirror == NULL || !state->struct_already) {return;}
+    
+    record_header header = {0};
+    
+    while (address <= state->last_record_addr) {
+        if (g_flash_hal.read(address, &header, header_size) != ERR_SUCCESS) {return;}
+        
+        state->mirror_valid = decode_record(state, address, &header, state->mirror, state->mirror_capacity, &state->mirror_length, state->mirror_valid, state->keyframe_seq);
+        if (!state->mirror_valid) {return;}
+        
+        if (is_delta_codec(record_codec_of(&header))) {
+            state->since_keyframe++;
+        } else {
+            state->since_keyframe = 0;
+            state->keyframe_seq = header.sequence;
+        }
+        
+        address += get_total_record_size(header.content_length);
+    }
+}
+
+flash_error flashlog_enable_codec(FlashlogState *state, void *work, uint32_t capacity, uint16_t keyframe_interval) {
+    if (state == NULL || work == NULL) {return ERR_NULL_PTR;}
+    if (state->mirror == NULL) {return ERR_UNINITIALIZED;}
+    if (capacity == 0) {return ERR_INVALID_ARGUMENT;}
+    
+    state->codec_buffer = (uint8_t*)work;
+    state->codec_capacity = capacity;
+    state->keyframe_interval = keyframe_interval;
+    state->since_keyframe = 0;
+    state->patch_deltas = 0;
+    return ERR_SUCCESS;
+}
+
+flash_error flashlog_enable_snapshots(FlashlogState *state, void *work, uint32_t capacity, uint16_t snapshot_interval) {
+    // snapshot_interval counts the snapshot itself, keyframe_interval only the deltas after it
+    flash_error error = flashlog_enable_codec(state, work, capacity, snapshot_interval > 0 ? snapshot_interval - 1 : 0);
+    if (error != ERR_SUCCESS) {return error;}
+    
+    state->patch_deltas = 1;
+    return ERR_SUCCESS;
+}
+
+// picks how the payload gets stored and points stored at the bytes to program.
+// deltas are only taken against a mirror holding a record of the same length
+static uint32_t encode_payload(FlashlogState *state, const void *ptr, uint32_t size, int allow_delta, const uint8_t **stored, uint32_t *stored_size) {
+    *stored = (const uint8_t*)ptr;
+    *stored_size = size;
+    
+    // anything the mirror can't hold has to stay readable straight from flash
+    if (state->codec_buffer == NULL || size > state->mirror_capacity) {return CODEC_RAW;}
+    
+    uint32_t codec = CODEC_RLE;
+    const uint8_t *base = NULL;
+    
+    if (allow_delta && state->mirror_valid && state->mirror_length == size && state->since_keyframe < state->keyframe_interval) {
+        if (state->patch_deltas) {
+            uint32_t patched = patch_encode((const uint8_t*)ptr, state->mirror, size, state->keyframe_seq, state->codec_buffer, min(state->codec_capacity, size - 1));
+            if (patched != 0) {
+                *stored = state->codec_buffer;
+                *stored_size = patched;
+                return CODEC_PATCH;
+            }
+            // too much changed for a patch to pay off, write a fresh snapshot instead
+        } else {
+            codec = CODEC_DELTA_RLE;
+            base = state->mirror;
+        }
+    }
+    
+    // only accept an encoding that is strictly smaller than the raw payload
+    uint32_t encoded = rle_encode((const uint8_t*)ptr, base, size, state->codec_buffer, min(state->codec_capacity, size - 1));
+    if (encoded == 0) {return CODEC_RAW;}
+    
+    *stored = state->codec_buffer;
+    *stored_size = encoded;
+    return codec;
+}
+
+flash_error flashlog_set_integrity(FlashlogState *state, integrity_kind kind) {
+    if (state == NULL) {return ERR_NULL_PTR;}
+    if (!integrity_is_known(kind)) {return ERR_INVALID_ARGUMENT;}
+    
+    state->integrity = kind;
+    return ERR_SUCCESS;
+}
+
 int flashlog_init(FlashlogState *state) {
     if (!state) {return -1;}
+    state->page_active = 0;
     if (!g_flash_hal.init || !g_flash_hal.read || !g_flash_hal.write || !g_flash_hal.erase) {
         return -1;
     }
@@ -92,6 +395,7 @@ int flashlog_init(FlashlogState *state) {
     uint32_t highest_sequence = 0;
     
     bool found_records = false;
+    uint32_t legacy_sectors = 0;
     
     record_header header;
     
@@ -134,6 +438,8 @@ int flashlog_init(FlashlogState *state) {
                 debug_print("Header crc %u\n\n", header.header_crc);
             }
             
+            if (header.magic == LEGACY_HEADER_MAGIC) {legacy_sectors++;}
+            
             continue;
         }
         
@@ -152,11 +458,21 @@ int flashlog_init(FlashlogState *state) {
     
     // if we didn't find any records than set to the default blank state
     
+    // an image from before the header format change would look empty and get erased by the
+    // first write, leave it alone so it can be migrated
+    if (!found_records && legacy_sectors > 0) {
+        debug_print("Found %u sectors in the old record format, not mounting\n", legacy_sectors);
+        return ERR_UNSUPPORTED;
+    }
+    
     if (!found_records) {
         debug_print("Didn't find any records, setting to default\n");
         state->last_record_addr = 0; 
         state->last_record_seq = 0; 
+        state->last_record_length = 0;
         state->struct_already = 0;
+        state->mirror_valid = 0;
+        build_time_index(state);
         return 0;
     }
     
@@ -164,6 +480,9 @@ int flashlog_init(FlashlogState *state) {
     
     uint32_t address = highest_sequence_index * SECTOR_SIZE;
     uint32_t max_sector_address = address + SECTOR_SIZE;
+    uint32_t latest_address = address;
+    uint32_t latest_length = 0;
+    uint32_t keyframe_address = address; // the sector always starts with a keyframe
     
     debug_print("Starting narrow scan at %u\n", address);
     while (true) {
@@ -189,6 +508,10 @@ int flashlog_init(FlashlogState *state) {
             highest_sequence = header.sequence;
         }
         
+        latest_address = address;
+        latest_length = header.content_length;
+        if (!is_delta_codec(record_codec_of(&header))) {keyframe_address = address;}
+        
         address += get_total_record_size(header.content_length);
         
         uint32_t min_next = address + header_size + sizeof(uint32_t);
@@ -199,11 +522,17 @@ int flashlog_init(FlashlogState *state) {
         }
     }
     
-    state->last_record_addr = round_up(address, FLASH_ALIGN);
+    // last_record_addr points at the latest record itself, not the free space after it.
+    // read_latest reads that record's header back
+    state->last_record_addr = latest_address;
     state->last_record_seq = highest_sequence;
+    state->last_record_length = latest_length;
     state->struct_already = 1;
     
-    debug_print("Found records, setting to addr: %u, seq: %u\n", address, highest_sequence);
+    rebuild_mirror(state, keyframe_address);
+    build_time_index(state);
+    
+    debug_print("Found records, setting to addr: %u, seq: %u\n", latest_address, highest_sequence);
     
     return 0;
 }
@@ -214,11 +543,23 @@ int flashlog_deinit() {
 }
 
 flash_error flashlog_write(FlashlogState *state, const void *ptr, uint32_t size) {
-    if (ptr == NULL) {return ERR_NULL_PTR;}
-    if (size + header_size > SECTOR_SIZE) {return ERR_OUT_OF_BOUNDS;}
+    return flashlog_write_durable(state, ptr, size, DURABILITY_COMMITTED);
+}
+
+flash_error flashlog_flush(FlashlogState *state) {
+    if (state == NULL) {return ERR_NULL_PTR;}
     
-    // now we have a record that will fit in a sector
-    uint32_t sector_bytes_left = round_up(state->last_record_addr, SECTOR_SIZE) - (SECTOR_SIZE - state->last_record_addr);
+    flash_error error = flush_page(state);
+    if (error != ERR_SUCCESS) {return error;}
+    
+    if (g_flash_hal.sync) {return g_flash_hal.sync();}
+    return ERR_SUCCESS;
+}
+
+flash_error flashlog_write_durable(FlashlogState *state, const void *ptr, uint32_t size, flashlog_durability durability) {
+    if (ptr == NULL) {return ERR_NULL_PTR;}
+    if (size == 0) {return ERR_INVALID_ARGUMENT;}
+    if (size > max_content_length) {return ERR_OUT_OF_BOUNDS;}
     
     // we could techinically split writes between sectors but for now to keep logic simple
     // we will just skip to the next one
@@ -227,98 +568,262 @@ flash_error flashlog_write(FlashlogState *state, const void *ptr, uint32_t size)
     // add split writes for sectors
     
     uint32_t write_addr = 0;
+    int new_sector = 1; // a fresh log starts by erasing sector 0 in case it holds half written junk
     
     if (state->struct_already) {
-        if (sector_bytes_left < get_total_record_size(size)) {
-            debug_print("writing %u bytes, sector has %u bytes left\n", get_total_record_size(size), sector_bytes_left);
-            write_addr = round_up(state->last_record_addr, SECTOR_SIZE);
-            g_flash_hal.erase(write_addr / SECTOR_SIZE);
+        // kept in RAM, reading the header back would wait for a HAL that queues its programs
+        write_addr = state->last_record_addr + get_total_record_size(state->last_record_length);
+        new_sector = 0;
+    }
+    
+    const uint8_t *stored = NULL;
+    uint32_t stored_size = 0;
+    uint32_t codec = encode_payload(state, ptr, size, !new_sector, &stored, &stored_size);
+    
+    if (!new_sector) {
+        uint32_t sector_end = round_down(state->last_record_addr, SECTOR_SIZE) + SECTOR_SIZE;
+        
+        if (write_addr + get_total_record_size(stored_size) > sector_end) {
+            debug_print("writing %u bytes, sector has %u bytes left\n", get_total_record_size(stored_size), sector_end - write_addr);
+            write_addr = sector_end % PARTITION_SIZE;
+            new_sector = 1;
+            
+            // the delta base stays behind in the old sector, so every sector opens with a keyframe
+            codec = encode_payload(state, ptr, size, 0, &stored, &stored_size);
             
             debug_print("state has records, skipping to next sector address: %u\n", write_addr);
         } else {
-            record_header last_header = {0};
-            g_flash_hal.read(state->last_record_addr, &last_header, header_size); // this header shouldn't be random data as the initial memory scan would catch it
-            write_addr = round_up(state->last_record_addr + get_total_record_size(last_header.content_length), FLASH_ALIGN);
-            
             debug_print("state has records, address: %u\n", write_addr);
         }
     } else {
         debug_print("state has no records: starting at %u\n", write_addr);
     }
     
+    if (new_sector) {
+        // whatever is buffered belongs to the previous sector
+        flash_error flush_error = flush_page(state);
+        if (flush_error != ERR_SUCCESS) {return flush_error;}
+        
+        // readers that were looking at this sector will notice and retry
+        seqlock_epoch_bump(&state->reclaim_epoch);
+        scrub_note_erase(state, write_addr / SECTOR_SIZE);
+        
+        flash_error erase_error = g_flash_hal.erase(write_addr / SECTOR_SIZE);
+        if (erase_error != ERR_SUCCESS) {
+            debug_print("Error erasing sector %u: %i\n", write_addr / SECTOR_SIZE, erase_error);
+            return erase_error;
+        }
+    }
     
     record_header header = {0};
     header.magic = HEADER_MAGIC;
     header.sequence = state->last_record_seq + 1;
-    header.content_crc = crc32_byte((uint8_t*)ptr, size);
-    header.content_length = size;
-    header.header_crc = 0xFF; // temp for now. TODO add calculation for other fields later
-    
-    uint8_t error = 0;
-    
-    debug_print("Writing header to %u\n", write_addr);
-    
-    error = g_flash_hal.write(write_addr, &header, header_size);
-    if (error != 0) {
-        debug_print("Error writing header: %i\n", error);
-        return error;
+    header.content_length = stored_size;
+    header.flags = (state->integrity & FLAG_INTEGRITY_MASK) | ((codec << FLAG_CODEC_SHIFT) & FLAG_CODEC_MASK);
+    header.content_crc = 0;
+    if (state->integrity != INTEGRITY_HEADER_ONLY) {
+        header.content_crc = integrity_compute(state->integrity, stored, stored_size);
+    }
+    if (state->clock) {
+        header.timestamp = state->clock();
+        header.flags |= FLAG_TIMESTAMP;
     }
+    header.header_crc = compute_header_crc(&header);
     
-    debug_print("Writing content to %u\n", write_addr + header_size);
+    flash_error error = ERR_SUCCESS;
     
-    error = g_flash_hal.write(write_addr + header_size, ptr, size);
-    if (error != 0) {
-        debug_print("Error content header: %i\n", error);
-        return error;
-    }
+    uint32_t commit_addr = round_up(write_addr + header_size + stored_size, FLASH_ALIGN);
     
-    error = g_flash_hal.write(round_up(write_addr + header_size + size, FLASH_ALIGN), &COMMIT_MAGIC, sizeof(uint32_t));
-    if (error != 0) {
-        debug_print("Error commit magic: %i\n", error);
-        return error;
+    if (state->page_buffer == NULL && g_flash_hal.write_batch) {
+        // let the HAL take the whole record in one go
+        flash_write_segment segments[3] = {
+            {write_addr, &header, header_size},
+            {write_addr + header_size, stored, stored_size},
+            {commit_addr, &COMMIT_MAGIC, sizeof(uint32_t)}
+        };
+        
+        debug_print("Writing record batch to %u\n", write_addr);
+        
+        error = g_flash_hal.write_batch(segments, 3);
+        if (error != 0) {
+            debug_print("Error writing record batch: %i\n", error);
+            return error;
+        }
+    } else {
+        debug_print("Writing header to %u\n", write_addr);
+        
+        error = log_program(state, write_addr, &header, header_size);
+        if (error != 0) {
+            debug_print("Error writing header: %i\n", error);
+            return error;
+        }
+        
+        debug_print("Writing content to %u\n", write_addr + header_size);
+        
+        error = log_program(state, write_addr + header_size, stored, stored_size);
+        if (error != 0) {
+            debug_print("Error content header: %i\n", error);
+            return error;
+        }
+        
+        error = log_program(state, commit_addr, &COMMIT_MAGIC, sizeof(uint32_t));
+        if (error != 0) {
+            debug_print("Error commit magic: %i\n", error);
+            return error;
+        }
     }
     
     debug_print("Completed the write\n");
     
+    seqlock_write_begin(&state->publish_seq);
+    
     state->last_record_addr = write_addr;
     state->last_record_seq++;
+    state->last_record_length = stored_size;
     state->struct_already = 1;
     
+    time_index_note(state, write_addr, &header, new_sector);
+    
+    if (is_delta_codec(codec)) {
+        state->since_keyframe++;
+    } else {
+        state->since_keyframe = 0;
+        state->keyframe_seq = header.sequence;
+    }
+    
+    if (state->mirror != NULL) {
+        if (size <= state->mirror_capacity) {
+            memcpy(state->mirror, ptr, size);
+            state->mirror_length = size;
+            state->mirror_valid = 1;
+        } else {
+            state->mirror_valid = 0;
+        }
+    }
+    
+    seqlock_write_end(&state->publish_seq);
+    
+    // the record is part of the log from here on, a failed flush just leaves it queued in the buffer
+    if (durability != DURABILITY_BUFFERED) {
+        error = flush_page(state);
+        if (error != ERR_SUCCESS) {return error;}
+    }
+    
+    if (durability == DURABILITY_COMMITTED && g_flash_hal.sync) {
+        error = g_flash_hal.sync();
+    }
+    
     return error;
 }
 
-uint32_t get_latest_size(FlashlogState *state) {
+// concurrent readers only look at the unflushed part of the write buffer under the seqlock,
+// everything else they read straight from flash
+static flash_error head_read(FlashlogState *state, uint32_t addr, void *ptr, uint32_t len, int through_buffer) {
+    if (through_buffer) {return log_read(state, addr, ptr, len);}
+    return g_flash_hal.read(addr, ptr, len);
+}
+
+static int head_in_write_buffer(FlashlogState *state) {
+    return state->page_buffer != NULL && state->page_active && state->page_flushed != state->page_fill;
+}
+
+static uint32_t record_size_at(FlashlogState *state, uint32_t address, int through_buffer) {
     record_header header = {0};
-    g_flash_hal.read(state->last_record_addr, &header, header_size);
+    head_read(state, address, &header, header_size, through_buffer);
+    if (record_codec_of(&header) != CODEC_RAW) {return 0;} // decoded size is only known through the mirror
     return header.content_length;
 }
 
-flash_error read_latest(FlashlogState *state, void *ptr, uint32_t max_size) {
-    if (max_size == 0) {return ERR_INVALID_ARGUMENT;}
-    if (ptr == NULL) {return ERR_NULL_PTR;}
+static flash_error read_record_at(FlashlogState *state, uint32_t address, void *ptr, uint32_t max_size, int through_buffer) {
+    record_header header = {0};
     
-    if (!state->struct_already) {return ERR_NO_RECORD;}
+    if (flashlog_record_is_bad(state, address)) {return ERR_CORRUPT;}
     
-    record_header header = {0};
+    debug_print("Reading header from %u\n", address);
+    head_read(state, address, &header, header_size, through_buffer);
     
-    debug_print("Reading header from %u\n", state->last_record_addr);
-    g_flash_hal.read(state->last_record_addr, &header, header_size);
+    if (!is_valid_header(&header)) {return ERR_CORRUPT;}
     
-    if (crc32_byte((uint8_t*)&header, header_size) != header.header_crc) {
-        //return ERR_NO_RECORD; // temp for now
-    }
+    // encoded records can only be read back through the mirror
+    if (record_codec_of(&header) != CODEC_RAW) {return ERR_UNSUPPORTED;}
     
     uint32_t read_size = min(max_size, header.content_length);
     
     // check for commit signature
-    uint32_t commit_address = round_up(state->last_record_addr + header_size + header.content_length, FLASH_ALIGN);
+    uint32_t commit_address = round_up(address + header_size + header.content_length, FLASH_ALIGN);
     uint32_t commit = 0;
     
-    if (g_flash_hal.read(commit_address, &commit, sizeof(uint32_t)) != ERR_SUCCESS) {return ERR_CORRUPT;}
+    if (head_read(state, commit_address, &commit, sizeof(uint32_t), through_buffer) != ERR_SUCCESS) {return ERR_CORRUPT;}
     
     if (commit != COMMIT_MAGIC) {return ERR_NO_COMMIT;}
     
-    debug_print("Reading content from %u\n", state->last_record_addr + header_size);
+    debug_print("Reading content from %u\n", address + header_size);
+    
+    return head_read(state, address + header_size, ptr, read_size, through_buffer);
+}
+
+uint32_t get_latest_size(FlashlogState *state) {
+    while (1) {
+        uint32_t seq = seqlock_read_begin(&state->publish_seq);
+        
+        if (state->mirror_valid) {
+            uint32_t length = state->mirror_length;
+            if (seqlock_read_retry(&state->publish_seq, seq)) {continue;}
+            return length;
+        }
+        
+        uint32_t address = state->last_record_addr;
+        uint32_t reclaim = seqlock_epoch(&state->reclaim_epoch);
+        
+        if (head_in_write_buffer(state)) {
+            uint32_t length = record_size_at(state, address, 1);
+            if (seqlock_read_retry(&state->publish_seq, seq)) {continue;}
+            return length;
+        }
+        
+        if (seqlock_read_retry(&state->publish_seq, seq)) {continue;}
+        
+        uint32_t length = record_size_at(state, address, 0);
+        if (seqlock_epoch_changed(&state->reclaim_epoch, reclaim)) {continue;}
+        return length;
+    }
+}
+
+flash_error read_latest(FlashlogState *state, void *ptr, uint32_t max_size) {
+    if (max_size == 0) {return ERR_INVALID_ARGUMENT;}
+    if (ptr == NULL) {return ERR_NULL_PTR;}
     
-    return g_flash_hal.read(state->last_record_addr + header_size, ptr, read_size);
-}
\ No newline at end of file
+    while (1) {
+        uint32_t seq = seqlock_read_begin(&state->publish_seq);
+        
+        if (!state->struct_already) {
+            if (seqlock_read_retry(&state->publish_seq, seq)) {continue;}
+            return ERR_NO_RECORD;
+        }
+        
+        // the mirror holds the latest written payload, checked when it was written or decoded at
+        // mount. a buffered write may not have reached flash yet, but read_latest would return
+        // it through the write buffer anyway
+        if (state->mirror_valid) {
+            memcpy(ptr, state->mirror, min(max_size, state->mirror_length));
+            if (seqlock_read_retry(&state->publish_seq, seq)) {continue;}
+            return ERR_SUCCESS;
+        }
+        
+        uint32_t address = state->last_record_addr;
+        uint32_t reclaim = seqlock_epoch(&state->reclaim_epoch);
+        
+        if (head_in_write_buffer(state)) {
+            flash_error error = read_record_at(state, address, ptr, max_size, 1);
+            if (seqlock_read_retry(&state->publish_seq, seq)) {continue;}
+            return error;
+        }
+        
+        if (seqlock_read_retry(&state->publish_seq, seq)) {continue;}
+        
+        // committed flash only changes when its sector is erased, newer writes don't matter to us
+        flash_error error = read_record_at(state, address, ptr, max_size, 0);
+        if (seqlock_epoch_changed(&state->reclaim_epoch, reclaim)) {continue;}
+        return error;
+    }
+}
@@ -3,11 +3,73 @@
 
 #include "../hal/flash_hal.h"
 #include "../include/globals.h"
+#include "../include/integrity/integrity.h"
+
+#define FLASHLOG_SECTORS (PARTITION_SIZE / SECTOR_SIZE)
+
+// min/max timestamp per sector so time queries can skip whole sectors, see flashlog_enable_timestamps
+typedef struct {
+    uint32_t min_time[FLASHLOG_SECTORS];
+    uint32_t max_time[FLASHLOG_SECTORS];
+    uint8_t has_time[FLASHLOG_SECTORS];
+} flashlog_time_index;
+
+// one bit per FLASH_ALIGN address, set where the scrub found a damaged record, see flashlog_enable_scrub
+#define FLASHLOG_BAD_MAP_WORDS (PARTITION_SIZE / FLASH_ALIGN / 32)
+
+typedef struct {
+    uint32_t bits[FLASHLOG_BAD_MAP_WORDS];
+} flashlog_bad_map;
 
 typedef struct {
     uint32_t last_record_addr;
     uint32_t last_record_seq;
+    uint32_t last_record_length; // stored content_length of that record, so writes don't read its header back
     int struct_already;
+    
+    // optional RAM copy of the latest written payload (with a write buffer it may not be
+    // programmed yet, see DURABILITY_BUFFERED). when valid, read_latest and
+    // get_latest_size are served from here without touching the HAL
+    // see flashlog_attach_mirror
+    uint8_t *mirror;
+    uint32_t mirror_capacity;
+    uint32_t mirror_length;
+    int mirror_valid;
+    
+    // integrity_kind used for new records, defaults to INTEGRITY_CRC32. existing records are
+    // always verified with whatever their own header flags say
+    uint8_t integrity;
+    
+    // optional delta + rle codec stage, see flashlog_enable_codec
+    uint8_t *codec_buffer;
+    uint32_t codec_capacity;
+    uint16_t keyframe_interval;
+    uint16_t since_keyframe; // deltas written since the last keyframe
+    uint32_t keyframe_seq;   // sequence of the last keyframe, the base patch deltas point at
+    uint8_t patch_deltas;    // deltas are field patches (flashlog_enable_snapshots) instead of xor + rle
+    
+    // optional page write-back buffer, see flashlog_attach_write_buffer
+    uint8_t *page_buffer;
+    uint32_t page_size;
+    uint32_t page_addr;     // flash address of page_buffer[0]
+    uint32_t page_fill;     // bytes of the page that hold record data
+    uint32_t page_flushed;  // bytes of the page that have been programmed
+    int page_active;
+    
+    // optional record timestamps, see flashlog_enable_timestamps
+    uint32_t (*clock)();
+    flashlog_time_index *time_index;
+    
+    // optional background scrub, see flashlog_enable_scrub. the cursor is where the next
+    // flashlog_scrub call picks up, always on a record boundary
+    flashlog_bad_map *bad_map;
+    uint32_t scrub_sector;
+    uint32_t scrub_offset;
+    
+    // only used with FLASHLOG_CONCURRENT, see seqlock.h. lets other threads call read_latest and
+    // get_latest_size while one thread writes, everything else stays on the writer thread
+    uint32_t publish_seq;
+    uint32_t reclaim_epoch;
 } FlashlogState;
 
 typedef struct {
@@ -15,16 +77,132 @@ typedef struct {
     uint32_t sequence;
     uint32_t content_length;
     uint32_t content_crc;
-    uint32_t header_crc;
+    uint32_t flags;
+    uint32_t timestamp; // only meaningful when FLAG_TIMESTAMP is set
+    uint32_t header_crc; // crc32 over every field before it, so this has to stay the last field
 } record_header; // THIS HEADER HAS TO BE A MULTIPLE OF THE FLASH_ALIGN GLOBAL CONST
 
+// record_header.flags layout
+#define FLAG_INTEGRITY_MASK 0x0000000Fu // integrity_kind the content_crc was computed with
+#define FLAG_CODEC_MASK 0x00000030u // record_codec the payload was stored with
+#define FLAG_CODEC_SHIFT 4
+#define FLAG_TIMESTAMP 0x00000040u // the timestamp field was filled in
+
+// content_length and content_crc always describe the stored bytes, so a record can be
+// validated without decoding it
+typedef enum {
+    CODEC_RAW,        // payload stored as is, always a keyframe
+    CODEC_RLE,        // rle of the payload, a keyframe
+    CODEC_DELTA_RLE,  // rle of the payload xor the previous record, which has to be decoded first
+    CODEC_PATCH,      // field patches against the previous record, see codec/patch.h
+    CODEC_COUNT
+} record_codec;
+
+// how far a write has to get before flashlog_write_durable returns
+typedef enum {
+    DURABILITY_BUFFERED,  // the record may still only be in the page buffer
+    DURABILITY_FLUSHED,   // every byte of the record has been handed to the HAL
+    DURABILITY_COMMITTED  // flushed, and the HAL sync hook has run if it has one
+} flashlog_durability;
+
 static const uint32_t header_size = sizeof(record_header);
 static const uint32_t max_content_length = SECTOR_SIZE - header_size - sizeof(uint32_t);
 
+// gives the log a caller owned buffer to keep the latest payload in. has to be called before
+// flashlog_init so the buffer can be filled at mount. records larger than capacity fall back
+// to reading from flash
+flash_error flashlog_attach_mirror(FlashlogState *state, void *buffer, uint32_t capacity);
+
+// turns on the codec stage for new records. the mirror has to be attached first, it holds the
+// previous record that deltas are taken against. work is scratch space for the encoded payload,
+// anything that doesn't shrink is stored raw. after keyframe_interval deltas (and at the start
+// of every sector) a keyframe is written, which bounds the decode chain at mount
+flash_error flashlog_enable_codec(FlashlogState *state, void *work, uint32_t capacity, uint16_t keyframe_interval);
+
+// stamps every new record with clock(). index is optional caller owned storage that gets built
+// at mount (one header walk per sector) and kept up to date on write, flashlog_query_time uses
+// it to skip sectors outside the requested window
+flash_error flashlog_enable_timestamps(FlashlogState *state, uint32_t (*clock)(), flashlog_time_index *index);
+
+// snapshot + delta persistence for a large state struct written with flashlog_write. every
+// snapshot_interval updates (and at the start of every sector) the full struct is written as a
+// snapshot, in between only the changed fields go out as patch records pointing at their
+// snapshot's sequence. mount restores by replaying the patches on top of the latest snapshot,
+// read_latest then returns the restored state. needs the mirror attached first, work is
+// scratch space for building patches. this is the codec stage with a different delta encoding,
+// so it replaces flashlog_enable_codec rather than combining with it
+flash_error flashlog_enable_snapshots(FlashlogState *state, void *work, uint32_t capacity, uint16_t snapshot_interval);
+
+// picks the payload check for records written from now on, see integrity_kind
+flash_error flashlog_set_integrity(FlashlogState *state, integrity_kind kind);
+
+// gives the log a caller owned buffer that records are gathered in and programmed a whole page
+// at a time. size has to be a multiple of FLASH_ALIGN that divides SECTOR_SIZE, normally
+// FLASH_PAGE_SIZE. without one every write goes straight to the HAL.
+// flashlog_deinit doesn't know the state, so call flashlog_flush before it, records still in
+// the buffer are lost otherwise
+flash_error flashlog_attach_write_buffer(FlashlogState *state, void *page, uint32_t size);
+
+// mounts the partition. nonzero on failure, ERR_UNSUPPORTED when it only holds records in the
+// old header format (LEGACY_HEADER_MAGIC), which would otherwise be erased as empty
 int flashlog_init(FlashlogState *state);
 int flashlog_deinit();
-flash_error flashlog_write(FlashlogState *state, const void * ptr, uint32_t size);
+flash_error flashlog_write(FlashlogState *state, const void * ptr, uint32_t size); // DURABILITY_COMMITTED
+flash_error flashlog_write_durable(FlashlogState *state, const void * ptr, uint32_t size, flashlog_durability durability);
+
+// programs anything still sitting in the write buffer and syncs the HAL
+flash_error flashlog_flush(FlashlogState *state);
+
+typedef struct {
+    uint32_t checked;   // records verified
+    uint32_t bad;       // of those, the ones that failed
+    uint32_t bytes;     // bytes read off flash
+    uint8_t wrapped;    // the cursor finished a pass over the whole partition
+} flashlog_scrub_result;
+
+// turns on the scrub. map is caller owned and gets cleared, afterwards it marks every record
+// the scrub found with a bad payload check or a missing commit (and headers that stopped a
+// sector walk). read_latest and flashlog_query_time skip marked records instead of reading
+// them, an erase clears the bits of its sector. RAM only, mount starts clean
+flash_error flashlog_enable_scrub(FlashlogState *state, flashlog_bad_map *map);
+
+// verifies records from the cursor on until about budget bytes have been read, at least one
+// record per call, so it can run in idle time. the cursor wraps around the partition, records
+// still in the write buffer are left for the next pass
+flash_error flashlog_scrub(FlashlogState *state, uint32_t budget, flashlog_scrub_result *result);
+
+// one full pass over every sector without touching the cursor. with FLASHLOG_CONCURRENT the
+// sectors are split over threads (the calling one included), the HAL read has to be thread safe
+flash_error flashlog_scrub_all(FlashlogState *state, uint32_t threads, flashlog_scrub_result *result);
+
+int flashlog_record_is_bad(const FlashlogState *state, uint32_t address);
+typedef struct {
+    uint32_t sequence;
+    uint32_t timestamp;
+    uint32_t address;
+} flashlog_record_info;
+
+// return nonzero to stop the query early. data is NULL when the payload doesn't fit the buffer
+typedef int (*flashlog_record_callback)(void *ctx, const flashlog_record_info *info, const void *data, uint32_t length);
+
+// calls callback, oldest first, for every valid record stamped with t0 <= timestamp <= t1.
+// payloads are decoded into buffer. anything in the write buffer is flushed first
+flash_error flashlog_query_time(FlashlogState *state, uint32_t t0, uint32_t t1, flashlog_record_callback callback, void *ctx, void *buffer, uint32_t capacity);
+
 uint32_t get_latest_size(FlashlogState *state);
 flash_error read_latest(FlashlogState *state, void * ptr, uint32_t max_size);
 
+// record level access for front ends that walk the flash themselves (src/cpp, the inspector).
+// they all read through g_flash_hal
+int is_valid_header(const record_header *header);
+uint32_t get_total_record_size(uint32_t content_length);
+uint32_t record_codec_of(const record_header *header);
+int is_delta_codec(uint32_t codec);
+record_state is_valid_record(uint32_t address);
+
+// decodes the payload of the record at address into dst. keyframes replace the contents,
+// deltas are applied on top of the previous record which has to be in dst already (have_base),
+// patches also have to point at base_sequence. returns 1 and sets length on success
+int decode_record(FlashlogState *state, uint32_t address, const record_header *header, uint8_t *dst, uint32_t capacity, uint32_t *length, int have_base, uint32_t base_sequence);
+
 #endif
\ No newline at end of file
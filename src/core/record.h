@@ -0,0 +1,22 @@
+#ifndef RECORD_H
+#define RECORD_H
+
+// record level helpers shared between the files in src/core, not part of the public api
+
+#include "flashlog.h"
+
+int is_after(uint32_t a, uint32_t b);
+
+uint32_t compute_header_crc(const record_header *header);
+
+flash_error flush_page(FlashlogState *state);
+flash_error log_read(FlashlogState *state, uint32_t addr, void *ptr, uint32_t len);
+
+// time_index.c
+void build_time_index(FlashlogState *state);
+void time_index_note(FlashlogState *state, uint32_t address, const record_header *header, int new_sector);
+
+// scrub.c
+void scrub_note_erase(FlashlogState *state, uint32_t sector);
+
+#endif
@@ -0,0 +1,219 @@
+#include "flashlog.h"
+#include "record.h"
+#include "../include/debug/debug.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#ifdef FLASHLOG_CONCURRENT
+#include <pthread.h>
+#endif
+
+#define SCRUB_MAX_THREADS 8
+
+// reader threads look at the map while the writer thread scrubs
+static inline uint32_t load_word(const uint32_t *word) {
+#ifdef FLASHLOG_CONCURRENT
+    return __atomic_load_n(word, __ATOMIC_RELAXED);
+#else
+    return *word;
+#endif
+}
+
+static inline void set_bit(flashlog_bad_map *map, uint32_t address, int bad) {
+    uint32_t bit = address / FLASH_ALIGN;
+    uint32_t mask = 1u << (bit % 32);
+    uint32_t *word = &map->bits[bit / 32];
+    
+#ifdef FLASHLOG_CONCURRENT
+    if (bad) {__atomic_fetch_or(word, mask, __ATOMIC_RELAXED);}
+    else {__atomic_fetch_and(word, ~mask, __ATOMIC_RELAXED);}
+#else
+    if (bad) {*word |= mask;}
+    else {*word &= ~mask;}
+#endif
+}
+
+flash_error flashlog_enable_scrub(FlashlogState *state, flashlog_bad_map *map) {
+    if (state == NULL || map == NULL) {return ERR_NULL_PTR;}
+    
+    memset(map, 0, sizeof(flashlog_bad_map));
+    state->bad_map = map;
+    state->scrub_sector = 0;
+    state->scrub_offset = 0;
+    return ERR_SUCCESS;
+}
+
+int flashlog_record_is_bad(const FlashlogState *state, uint32_t address) {
+    if (state == NULL || state->bad_map == NULL || address >= PARTITION_SIZE) {return 0;}
+    
+    uint32_t bit = address / FLASH_ALIGN;
+    return (load_word(&state->bad_map->bits[bit / 32]) >> (bit % 32)) & 1;
+}
+
+void scrub_note_erase(FlashlogState *state, uint32_t sector) {
+    if (state->bad_map == NULL) {return;}
+    
+    // a sector is a whole number of words, nothing else shares them
+    uint32_t words = SECTOR_SIZE / FLASH_ALIGN / 32;
+    for (uint32_t i = 0; i < words; i++) {
+#ifdef FLASHLOG_CONCURRENT
+        __atomic_store_n(&state->bad_map->bits[sector * words + i], 0, __ATOMIC_RELAXED);
+#else
+        state->bad_map->bits[sector * words + i] = 0;
+#endif
+    }
+    
+    // the records the cursor was walking are gone
+    if (state->scrub_sector == sector) {state->scrub_offset = 0;}
+}
+
+static int is_erased(const record_header *header) {
+    const uint8_t *bytes = (const uint8_t*)header;
+    for (uint32_t i = 1; i < header_size; i++) {
+        if (bytes[i] != bytes[0]) {return 0;}
+    }
+    return bytes[0] == 0xFF || bytes[0] == 0x00;
+}
+
+// flash past this address is still in the write buffer and can't be judged yet. it always lies
+// inside the sector being written, PARTITION_SIZE means no limit
+static uint32_t scrub_limit(const FlashlogState *state) {
+    if (state->page_buffer == NULL || !state->page_active || state->page_flushed == state->page_fill) {return PARTITION_SIZE;}
+    return state->page_addr + state->page_flushed;
+}
+
+// checks the record at address. returns the bytes it covers, 0 when the sector ends there
+static uint32_t scrub_record(FlashlogState *state, uint32_t address, uint32_t limit, flashlog_scrub_result *result) {
+    uint32_t sector_end = (address / SECTOR_SIZE + 1) * SECTOR_SIZE;
+    if (limit / SECTOR_SIZE != address / SECTOR_SIZE) {limit = sector_end;}
+    if (address + header_size + sizeof(uint32_t) > sector_end || address + header_size > limit) {return 0;}
+    
+    record_header header;
+    if (g_flash_hal.read(address, &header, header_size) != ERR_SUCCESS) {return 0;}
+    result->bytes += header_size;
+    
+    uint32_t total = get_total_record_size(header.content_length);
+    
+    if (!is_valid_header(&header) || total > sector_end - address) {
+        // anything after a broken header is out of reach for mount and queries as well
+        if (!is_erased(&header)) {
+            debug_print("Scrub found a broken header at %u\n", address);
+            set_bit(state->bad_map, address, 1);
+            result->checked++;
+            result->bad++;
+        }
+        return 0;
+    }
+    
+    if (address + total > limit) {return 0;}
+    
+    int bad = is_valid_record(address) != RECORD_VALID;
+    if (bad) {debug_print("Scrub found a bad record at %u, seq %u\n", address, header.sequence);}
+    
+    set_bit(state->bad_map, address, bad);
+    result->checked++;
+    result->bad += bad;
+    result->bytes += total - header_size;
+    
+    return total;
+}
+
+flash_error flashlog_scrub(FlashlogState *state, uint32_t budget, flashlog_scrub_result *result) {
+    if (state == NULL || result == NULL) {return ERR_NULL_PTR;}
+    if (state->bad_map == NULL) {return ERR_UNINITIALIZED;}
+    
+    memset(result, 0, sizeof(flashlog_scrub_result));
+    uint32_t limit = scrub_limit(state);
+    
+    while (1) {
+        uint32_t address = state->scrub_sector * SECTOR_SIZE + state->scrub_offset;
+        uint32_t size = scrub_record(state, address, limit, result);
+        
+        if (size == 0) {
+            state->scrub_offset = 0;
+            state->scrub_sector++;
+            
+            if (state->scrub_sector >= FLASHLOG_SECTORS) {
+                state->scrub_sector = 0;
+                result->wrapped = 1;
+                break;
+            }
+        } else {
+            state->scrub_offset += size;
+        }
+        
+        if (result->bytes >= budget && result->checked > 0) {break;}
+    }
+    
+    return ERR_SUCCESS;
+}
+
+static void scrub_sector(FlashlogState *state, uint32_t sector, uint32_t limit, flashlog_scrub_result *result) {
+    uint32_t address = sector * SECTOR_SIZE;
+    
+    while (1) {
+        uint32_t size = scrub_record(state, address, limit, result);
+        if (size == 0) {break;}
+        address += size;
+    }
+}
+
+typedef struct {
+    FlashlogState *state;
+    uint32_t limit;
+    uint32_t next_sector;
+    flashlog_scrub_result results[FLASHLOG_SECTORS];
+} scrub_work;
+
+static void *scrub_worker(void *arg) {
+    scrub_work *work = (scrub_work*)arg;
+    
+    while (1) {
+#ifdef FLASHLOG_CONCURRENT
+        uint32_t sector = __atomic_fetch_add(&work->next_sector, 1, __ATOMIC_RELAXED);
+#else
+        uint32_t sector = work->next_sector++;
+#endif
+        if (sector >= FLASHLOG_SECTORS) {break;}
+        scrub_sector(work->state, sector, work->limit, &work->results[sector]);
+    }
+    
+    return NULL;
+}
+
+flash_error flashlog_scrub_all(FlashlogState *state, uint32_t threads, flashlog_scrub_result *result) {
+    if (state == NULL || result == NULL) {return ERR_NULL_PTR;}
+    if (state->bad_map == NULL) {return ERR_UNINITIALIZED;}
+    
+    scrub_work work;
+    memset(&work, 0, sizeof(work));
+    work.state = state;
+    work.limit = scrub_limit(state);
+    
+#ifdef FLASHLOG_CONCURRENT
+    pthread_t pool[SCRUB_MAX_THREADS];
+    uint32_t started = 0;
+    
+    // every sector only touches its own words of the map, so the threads don't share anything
+    while (started + 1 < threads && started < SCRUB_MAX_THREADS) {
+        if (pthread_create(&pool[started], NULL, &scrub_worker, &work) != 0) {break;}
+        started++;
+    }
+    scrub_worker(&work);
+    for (uint32_t i = 0; i < started; i++) {pthread_join(pool[i], NULL);}
+#else
+    (void)threads;
+    scrub_worker(&work);
+#endif
+    
+    memset(result, 0, sizeof(flashlog_scrub_result));
+    for (uint32_t sector = 0; sector < FLASHLOG_SECTORS; sector++) {
+        result->checked += work.results[sector].checked;
+        result->bad += work.results[sector].bad;
+        result->bytes += work.results[sector].bytes;
+    }
+    result->wrapped = 1;
+    
+    return ERR_SUCCESS;
+}
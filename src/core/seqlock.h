@@ -0,0 +1,63 @@
+#ifndef SEQLOCK_H
+#define SEQLOCK_H
+
+// single writer seqlock used to publish FlashlogState to reader threads (FLASHLOG_CONCURRENT).
+// the writer bumps the counter to odd before touching shared RAM state and back to even after,
+// readers copy what they need and retry if the counter moved underneath them.
+// without FLASHLOG_CONCURRENT everything here compiles away and readers never retry
+
+#include "stdint.h"
+
+#ifdef FLASHLOG_CONCURRENT
+
+static inline void seqlock_write_begin(uint32_t *seq) {
+    __atomic_store_n(seq, *seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void seqlock_write_end(uint32_t *seq) {
+    __atomic_store_n(seq, *seq + 1, __ATOMIC_RELEASE);
+}
+
+static inline uint32_t seqlock_read_begin(uint32_t *seq) {
+    uint32_t value;
+    while ((value = __atomic_load_n(seq, __ATOMIC_ACQUIRE)) & 1) {}
+    return value;
+}
+
+static inline int seqlock_read_retry(uint32_t *seq, uint32_t value) {
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(seq, __ATOMIC_RELAXED) != value;
+}
+
+// erase epochs. the writer bumps one before it erases a sector, a reader that saw the same
+// value before and after its flash reads knows nothing it read was erased in between
+static inline uint32_t seqlock_epoch(uint32_t *epoch) {
+    return __atomic_load_n(epoch, __ATOMIC_ACQUIRE);
+}
+
+// same pairing as write_begin/read_retry: the fence keeps the erase that follows from becoming
+// visible before the new epoch, the reader's fence keeps its flash reads before the re-check
+static inline void seqlock_epoch_bump(uint32_t *epoch) {
+    __atomic_store_n(epoch, *epoch + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline int seqlock_epoch_changed(uint32_t *epoch, uint32_t value) {
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(epoch, __ATOMIC_RELAXED) != value;
+}
+
+#else
+
+static inline void seqlock_write_begin(uint32_t *seq) {(void)seq;}
+static inline void seqlock_write_end(uint32_t *seq) {(void)seq;}
+static inline uint32_t seqlock_read_begin(uint32_t *seq) {(void)seq; return 0;}
+static inline int seqlock_read_retry(uint32_t *seq, uint32_t value) {(void)seq; (void)value; return 0;}
+static inline uint32_t seqlock_epoch(uint32_t *epoch) {(void)epoch; return 0;}
+static inline void seqlock_epoch_bump(uint32_t *epoch) {(void)epoch;}
+static inline int seqlock_epoch_changed(uint32_t *epoch, uint32_t value) {(void)epoch; (void)value; return 0;}
+
+#endif
+
+#endif
@@ -0,0 +1,143 @@
+#include "flashlog.h"
+#include "record.h"
+#include "../include/debug/debug.h"
+
+#include <stdint.h>
+#include <string.h>
+
+flash_error flashlog_enable_timestamps(FlashlogState *state, uint32_t (*clock)(), flashlog_time_index *index) {
+    if (state == NULL || clock == NULL) {return ERR_NULL_PTR;}
+    
+    state->clock = clock;
+    state->time_index = index;
+    if (index) {memset(index, 0, sizeof(flashlog_time_index));}
+    return ERR_SUCCESS;
+}
+
+static void index_add(flashlog_time_index *index, uint32_t sector, uint32_t timestamp) {
+    if (!index->has_time[sector]) {
+        index->min_time[sector] = timestamp;
+        index->max_time[sector] = timestamp;
+        index->has_time[sector] = 1;
+        return;
+    }
+    if (timestamp < index->min_time[sector]) {index->min_time[sector] = timestamp;}
+    if (timestamp > index->max_time[sector]) {index->max_time[sector] = timestamp;}
+}
+
+// walks the headers of every sector, payloads aren't touched. a query still validates each
+// record it hands out so a header that only looks right can't leak through
+void build_time_index(FlashlogState *state) {
+    flashlog_time_index *index = state->time_index;
+    if (index == NULL) {return;}
+    
+    memset(index, 0, sizeof(flashlog_time_index));
+    if (!state->struct_already) {return;}
+    
+    record_header header;
+    
+    for (uint32_t sector = 0; sector < FLASHLOG_SECTORS; sector++) {
+        uint32_t address = sector * SECTOR_SIZE;
+        uint32_t sector_end = address + SECTOR_SIZE;
+        
+        while (address + header_size + sizeof(uint32_t) <= sector_end) {
+            if (g_flash_hal.read(address, &header, header_size) != ERR_SUCCESS) {break;}
+            if (!is_valid_header(&header)) {break;}
+            
+            if (header.flags & FLAG_TIMESTAMP) {index_add(index, sector, header.timestamp);}
+            
+            address += get_total_record_size(header.content_length);
+        }
+        
+        if (index->has_time[sector]) {
+            debug_print("Sector %u covers time %u - %u\n", sector, index->min_time[sector], index->max_time[sector]);
+        }
+    }
+}
+
+void time_index_note(FlashlogState *state, uint32_t address, const record_header *header, int new_sector) {
+    flashlog_time_index *index = state->time_index;
+    if (index == NULL) {return;}
+    
+    uint32_t sector = address / SECTOR_SIZE;
+    
+    // the sector was just erased, whatever it covered before is gone
+    if (new_sector) {index->has_time[sector] = 0;}
+    
+    if (header->flags & FLAG_TIMESTAMP) {index_add(index, sector, header->timestamp);}
+}
+
+// walks one sector from its first record. encoded records are decoded as we go so deltas have
+// their base, raw records outside the window are only read when a delta needs them
+static int query_sector(FlashlogState *state, uint32_t sector, uint32_t t0, uint32_t t1, flashlog_record_callback callback, void *ctx, uint8_t *buffer, uint32_t capacity) {
+    uint32_t address = sector * SECTOR_SIZE;
+    uint32_t sector_end = address + SECTOR_SIZE;
+    
+    record_header header;
+    record_header previous_header;
+    uint32_t previous_address = 0;
+    int have_previous = 0;
+    
+    uint32_t length = 0;
+    int have_base = 0; // buffer holds the decoded previous record
+    uint32_t keyframe_seq = 0;
+    
+    while (address + header_size + sizeof(uint32_t) <= sector_end) {
+        if (g_flash_hal.read(address, &header, header_size) != ERR_SUCCESS) {break;}
+        if (!is_valid_header(&header)) {break;}
+        
+        uint32_t codec = record_codec_of(&header);
+        int matches = (header.flags & FLAG_TIMESTAMP) && header.timestamp >= t0 && header.timestamp <= t1;
+        
+        if (!is_delta_codec(codec)) {keyframe_seq = header.sequence;}
+        
+        if (matches || codec != CODEC_RAW) {
+            int valid = !flashlog_record_is_bad(state, address) && is_valid_record(address) == RECORD_VALID;
+            
+            if (valid && is_delta_codec(codec) && !have_base && have_previous && record_codec_of(&previous_header) == CODEC_RAW) {
+                have_base = decode_record(state, previous_address, &previous_header, buffer, capacity, &length, 0, keyframe_seq);
+            }
+            
+            have_base = valid && decode_record(state, address, &header, buffer, capacity, &length, have_base, keyframe_seq);
+            
+            if (matches && valid) {
+                flashlog_record_info info = {header.sequence, header.timestamp, address};
+                if (callback(ctx, &info, have_base ? buffer : NULL, have_base ? length : 0)) {return 1;}
+            }
+        } else {
+            have_base = 0;
+        }
+        
+        previous_header = header;
+        previous_address = address;
+        have_previous = 1;
+        
+        address += get_total_record_size(header.content_length);
+    }
+    
+    return 0;
+}
+
+flash_error flashlog_query_time(FlashlogState *state, uint32_t t0, uint32_t t1, flashlog_record_callback callback, void *ctx, void *buffer, uint32_t capacity) {
+    if (state == NULL || callback == NULL || buffer == NULL) {return ERR_NULL_PTR;}
+    if (t1 < t0) {return ERR_INVALID_ARGUMENT;}
+    if (!state->struct_already) {return ERR_NO_RECORD;}
+    
+    flash_error error = flush_page(state);
+    if (error != ERR_SUCCESS) {return error;}
+    
+    // the sector after the latest one holds the oldest records
+    uint32_t latest_sector = state->last_record_addr / SECTOR_SIZE;
+    flashlog_time_index *index = state->time_index;
+    
+    for (uint32_t i = 1; i <= FLASHLOG_SECTORS; i++) {
+        uint32_t sector = (latest_sector + i) % FLASHLOG_SECTORS;
+        
+        if (index && (!index->has_time[sector] || index->max_time[sector] < t0 || index->min_time[sector] > t1)) {continue;}
+        
+        debug_print("Querying sector %u\n", sector);
+        if (query_sector(state, sector, t0, t1, callback, ctx, (uint8_t*)buffer, capacity)) {break;}
+    }
+    
+    return ERR_SUCCESS;
+}
@@ -0,0 +1,337 @@
+#ifndef FLASHLOG_HPP
+#define FLASHLOG_HPP
+
+// header only C++ front end for the log, for firmware that stores one struct type.
+//
+//   struct Settings { uint32_t mode; float gain; };
+//   struct SpiFlash {
+//       static int init();
+//       static void deinit();
+//       static flash_error read(uint32_t addr, void *ptr, uint32_t len);
+//       static flash_error write(uint32_t addr, const void *ptr, uint32_t len);
+//       static flash_error erase(uint32_t sector);
+//       static flash_error sync();    // optional
+//   };
+//
+//   flashlog::FlashLog<Settings, SpiFlash> log;
+//   log.init();
+//   log.append(settings);
+//   log.latest(settings);
+//   for (const Settings &s : log) { ... }
+//
+// the HAL is a policy class with static functions instead of the g_flash_hal table. the core is
+// plain C compiled once, so init() binds the policy into g_flash_hal for it, but latest() and
+// iteration read through Hal:: directly where the compiler can inline them. TableHal keeps
+// using whatever the C build put in g_flash_hal
+//
+// ONE MOUNTED LOG PER PROGRAM. the core has a single g_flash_hal and a fixed partition on it,
+// so two logs (with different policies or not) would write over each other's table and
+// records. init() fails with ERR_UNSUPPORTED while another FlashLog is mounted, deinit() or the
+// destructor of the mounted one frees the slot
+
+extern "C" {
+#include "../core/flashlog.h"
+}
+
+#include <stdint.h>
+#include <string.h>
+#include <type_traits>
+
+namespace flashlog {
+
+// the sizes the core was compiled with. a custom Geometry has to describe the same layout,
+// it exists so the sizes are usable in constant expressions on the C++ side
+struct DefaultGeometry {
+    static constexpr uint32_t sector_size = SECTOR_SIZE;
+    static constexpr uint32_t partition_size = PARTITION_SIZE;
+    static constexpr uint32_t align = FLASH_ALIGN;
+};
+
+// HAL policy that forwards to g_flash_hal, for HALs that only exist in C
+struct TableHal {
+    static int init() {return g_flash_hal.init ? g_flash_hal.init() : ERR_UNINITIALIZED;}
+    static void deinit() {if (g_flash_hal.deinit) {g_flash_hal.deinit();}}
+    static flash_error read(uint32_t addr, void *ptr, uint32_t len) {return g_flash_hal.read(addr, ptr, len);}
+    static flash_error write(uint32_t addr, const void *ptr, uint32_t len) {return g_flash_hal.write(addr, ptr, len);}
+    static flash_error erase(uint32_t sector) {return g_flash_hal.erase(sector);}
+};
+
+namespace detail {
+
+constexpr uint32_t round_up_to(uint32_t number, uint32_t multiple) {
+    return (number + multiple - 1) / multiple * multiple;
+}
+
+template <class Hal, class = void>
+struct has_sync : std::false_type {};
+
+template <class Hal>
+struct has_sync<Hal, decltype(void(&Hal::sync))> : std::true_type {};
+
+template <class Hal>
+typename std::enable_if<has_sync<Hal>::value>::type bind_sync() {g_flash_hal.sync = &Hal::sync;}
+
+template <class Hal>
+typename std::enable_if<!has_sync<Hal>::value>::type bind_sync() {g_flash_hal.sync = nullptr;}
+
+template <class Hal>
+struct Binder {
+    static void bind() {
+        g_flash_hal.init = &Hal::init;
+        g_flash_hal.deinit = &Hal::deinit;
+        g_flash_hal.read = &Hal::read;
+        g_flash_hal.write = &Hal::write;
+        g_flash_hal.erase = &Hal::erase;
+        g_flash_hal.write_batch = nullptr;
+        bind_sync<Hal>();
+    }
+};
+
+// the table already is the HAL
+template <>
+struct Binder<TableHal> {
+    static void bind() {}
+};
+
+// the log that currently owns g_flash_hal, see the top of the file
+inline void *&mounted_log() {
+    static void *log = nullptr;
+    return log;
+}
+
+inline bool claim_mount(void *log) {
+    void *expected = nullptr;
+#ifdef FLASHLOG_CONCURRENT
+    return __atomic_compare_exchange_n(&mounted_log(), &expected, log, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) || expected == log;
+#else
+    if (mounted_log() != expected && mounted_log() != log) {return false;}
+    mounted_log() = log;
+    return true;
+#endif
+}
+
+inline bool is_mounted(void *log) {
+#ifdef FLASHLOG_CONCURRENT
+    return __atomic_load_n(&mounted_log(), __ATOMIC_ACQUIRE) == log;
+#else
+    return mounted_log() == log;
+#endif
+}
+
+inline bool release_mount(void *log) {
+    void *expected = log;
+#ifdef FLASHLOG_CONCURRENT
+    return __atomic_compare_exchange_n(&mounted_log(), &expected, nullptr, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+#else
+    if (mounted_log() != expected) {return false;}
+    mounted_log() = nullptr;
+    return true;
+#endif
+}
+
+} // namespace detail
+
+template <class T, class Hal = TableHal, class Geometry = DefaultGeometry>
+class FlashLog {
+    static_assert(std::is_trivially_copyable<T>::value, "records are stored as raw bytes, T has to be trivially copyable");
+    static_assert(Geometry::sector_size == SECTOR_SIZE && Geometry::partition_size == PARTITION_SIZE && Geometry::align == FLASH_ALIGN,
+                  "Geometry has to match the one the core was built with");
+
+public:
+    static constexpr uint32_t sectors = Geometry::partition_size / Geometry::sector_size;
+    static constexpr uint32_t max_payload = Geometry::sector_size - sizeof(record_header) - sizeof(uint32_t);
+    static_assert(sizeof(T) <= max_payload, "T doesn't fit in a single record");
+    
+    // size of one raw record of T on flash and how many fit a sector
+    static constexpr uint32_t record_size = detail::round_up_to(sizeof(record_header) + sizeof(T), Geometry::align) + sizeof(uint32_t);
+    static constexpr uint32_t records_per_sector = Geometry::sector_size / record_size;
+    
+    FlashLog() : state_(), mirror_() {}
+    
+    ~FlashLog() {deinit();}
+    
+    FlashLog(const FlashLog &) = delete;
+    FlashLog &operator=(const FlashLog &) = delete;
+    
+    // for the optional stages (codec, timestamps, write buffer, integrity), before init
+    FlashlogState &state() {return state_;}
+    
+    // keeps the latest T in RAM so latest() never touches flash, before init
+    flash_error attach_mirror() {return flashlog_attach_mirror(&state_, &mirror_, sizeof(T));}
+    
+    // ERR_UNSUPPORTED when another FlashLog is mounted, its HAL stays bound
+    int init() {
+        if (!detail::claim_mount(this)) {return ERR_UNSUPPORTED;}
+        
+        detail::Binder<Hal>::bind();
+        int error = flashlog_init(&state_);
+        if (error != 0) {detail::release_mount(this);}
+        return error;
+    }
+    
+    // programs whatever is still in the write buffer first, flashlog_deinit alone would drop
+    // it. ERR_UNINITIALIZED when this log isn't the mounted one, the HAL is left alone then
+    int deinit() {
+        if (!detail::is_mounted(this)) {return ERR_UNINITIALIZED;}
+        
+        flash_error error = flush();
+        if (!detail::release_mount(this)) {return ERR_UNINITIALIZED;}
+        flashlog_deinit();
+        return error;
+    }
+    
+    flash_error append(const T &value, flashlog_durability durability = DURABILITY_COMMITTED) {
+        return flashlog_write_durable(&state_, &value, sizeof(T), durability);
+    }
+    
+    flash_error flush() {return flashlog_flush(&state_);}
+    
+    flash_error latest(T &out) {
+#ifndef FLASHLOG_CONCURRENT
+        // the common case reads straight through the policy, the rest (mirror, write buffer,
+        // encoded records) is left to the core
+        if (state_.struct_already && !state_.mirror_valid && !in_write_buffer()) {
+            record_header header;
+            uint32_t address = state_.last_record_addr;
+            if (flashlog_record_is_bad(&state_, address)) {return ERR_CORRUPT;}
+            if (Hal::read(address, &header, sizeof(header)) != ERR_SUCCESS) {return ERR_CORRUPT;}
+            if (!is_valid_header(&header)) {return ERR_CORRUPT;}
+            
+            if (record_codec_of(&header) == CODEC_RAW) {
+                if (header.content_length != sizeof(T)) {return ERR_CORRUPT;}
+                if (!committed(address, header.content_length)) {return ERR_NO_COMMIT;}
+                return Hal::read(address + sizeof(record_header), &out, sizeof(T));
+            }
+        }
+#endif
+        return read_latest(&state_, &out, sizeof(T));
+    }
+    
+    // walks every valid record oldest first. payloads are checked against their integrity
+    // kind, encoded records are decoded on top of the one before them. records the scrub
+    // marked bad are skipped
+    class iterator {
+    public:
+        iterator() : log_(nullptr) {}
+        
+        const T &operator*() const {return value_;}
+        const T *operator->() const {return &value_;}
+        
+        // sequence and flash address of the current record
+        uint32_t sequence() const {return header_.sequence;}
+        uint32_t address() const {return address_;}
+        
+        iterator &operator++() {
+            advance(address_ + get_total_record_size(header_.content_length));
+            return *this;
+        }
+        
+        bool operator==(const iterator &other) const {return log_ == other.log_ && (log_ == nullptr || address_ == other.address_);}
+        bool operator!=(const iterator &other) const {return !(*this == other);}
+    
+    private:
+        friend class FlashLog;
+        
+        iterator(FlashLog *log, uint32_t sector) : log_(log), sector_(sector), visited_(0), have_base_(0), keyframe_seq_(0), length_(sizeof(T)) {
+            advance(sector * Geometry::sector_size);
+        }
+        
+        void next_sector() {
+            visited_++;
+            sector_ = (sector_ + 1) % sectors;
+        }
+        
+        void advance(uint32_t address) {
+            while (visited_ < sectors) {
+                uint32_t sector_end = (sector_ + 1) * Geometry::sector_size;
+                
+                if (address < sector_ * Geometry::sector_size || address + sizeof(record_header) > sector_end) {
+                    next_sector();
+                    address = sector_ * Geometry::sector_size;
+                    continue;
+                }
+                
+                // the first record that doesn't parse ends the sector, same as the narrow scan
+                if (Hal::read(address, &header_, sizeof(header_)) != ERR_SUCCESS || !is_valid_header(&header_)
+                    || address + get_total_record_size(header_.content_length) > sector_end || !committed(address, header_.content_length)) {
+                    next_sector();
+                    address = sector_ * Geometry::sector_size;
+                    continue;
+                }
+                
+                if (load(address)) {
+                    address_ = address;
+                    return;
+                }
+                
+                have_base_ = 0;
+                address += get_total_record_size(header_.content_length);
+            }
+            
+            log_ = nullptr;
+        }
+        
+        int load(uint32_t address) {
+            uint32_t codec = record_codec_of(&header_);
+            if (flashlog_record_is_bad(&log_->state_, address)) {return 0;}
+            
+            if (codec == CODEC_RAW) {
+                if (header_.content_length != sizeof(T)) {return 0;}
+                if (Hal::read(address + sizeof(record_header), &value_, sizeof(T)) != ERR_SUCCESS) {return 0;}
+                
+                uint32_t kind = header_.flags & FLAG_INTEGRITY_MASK;
+                if (kind != INTEGRITY_HEADER_ONLY && integrity_compute(kind, reinterpret_cast<const uint8_t*>(&value_), sizeof(T)) != header_.content_crc) {return 0;}
+                
+                length_ = sizeof(T);
+            } else {
+                if (is_valid_record(address) != RECORD_VALID) {return 0;}
+                if (!decode_record(&log_->state_, address, &header_, reinterpret_cast<uint8_t*>(&value_), sizeof(T), &length_, have_base_, keyframe_seq_)) {return 0;}
+                if (length_ != sizeof(T)) {return 0;}
+            }
+            
+            have_base_ = 1;
+            if (!is_delta_codec(codec)) {keyframe_seq_ = header_.sequence;}
+            return 1;
+        }
+        
+        FlashLog *log_;
+        uint32_t sector_;
+        uint32_t visited_;
+        uint32_t address_;
+        record_header header_;
+        int have_base_;
+        uint32_t keyframe_seq_;
+        uint32_t length_;
+        T value_;
+    };
+    
+    // flushes the write buffer first, iteration only looks at flash
+    iterator begin() {
+        if (!state_.struct_already) {return end();}
+        if (in_write_buffer()) {flush();}
+        
+        // the sector after the head is the oldest one still around
+        return iterator(this, (state_.last_record_addr / Geometry::sector_size + 1) % sectors);
+    }
+    
+    iterator end() {return iterator();}
+
+private:
+    bool in_write_buffer() const {
+        return state_.page_buffer != nullptr && state_.page_active && state_.page_flushed != state_.page_fill;
+    }
+    
+    static bool committed(uint32_t address, uint32_t content_length) {
+        uint32_t commit = 0;
+        uint32_t commit_address = detail::round_up_to(address + sizeof(record_header) + content_length, Geometry::align);
+        if (Hal::read(commit_address, &commit, sizeof(commit)) != ERR_SUCCESS) {return false;}
+        return commit == COMMIT_MAGIC;
+    }
+    
+    FlashlogState state_;
+    T mirror_;
+};
+
+} // namespace flashlog
+
+#endif
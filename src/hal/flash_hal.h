@@ -4,6 +4,13 @@
 #include "../include/errors.h"
 #include "stdint.h"
 
+// one piece of a batched write, see flash_hal_t.write_batch
+typedef struct {
+    uint32_t addr;
+    const void *ptr;
+    uint32_t len;
+} flash_write_segment;
+
 typedef struct {
     // This function is expected to return 0 if successful. 
     // any other value will be returned to the application from the flashlog_init function
@@ -20,6 +27,16 @@ typedef struct {
     
     flash_error (*erase)(uint32_t);
     
+    // optional, can be NULL. makes everything written so far durable on the medium
+    // (fdatasync for file backed HALs). called for DURABILITY_COMMITTED writes and flashlog_flush
+    flash_error (*sync)();
+    
+    // optional, can be NULL. programs several segments in one call, the log uses it to hand over
+    // a record's header, payload and commit word together. gaps between segments are padded
+    // like write does. the last segment is the commit word, a HAL that can reorder writes
+    // has to make sure it doesn't land before the rest
+    flash_error (*write_batch)(const flash_write_segment *segments, uint32_t count);
+    
 } flash_hal_t;
 
 extern flash_hal_t g_flash_hal;
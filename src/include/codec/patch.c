@@ -0,0 +1,47 @@
+#include "patch.h"
+
+#include <string.h>
+
+static void put_u16(uint8_t *dst, uint32_t value) {
+    dst[0] = (uint8_t)value;
+    dst[1] = (uint8_t)(value >> 8);
+}
+
+uint32_t patch_encode(const uint8_t *src, const uint8_t *base, uint32_t len, uint32_t base_sequence, uint8_t *dst, uint32_t capacity) {
+    if (len > 0xFFFF || capacity < PATCH_PREFIX_SIZE) {return 0;}
+    
+    dst[0] = (uint8_t)base_sequence;
+    dst[1] = (uint8_t)(base_sequence >> 8);
+    dst[2] = (uint8_t)(base_sequence >> 16);
+    dst[3] = (uint8_t)(base_sequence >> 24);
+    uint32_t out = PATCH_PREFIX_SIZE;
+    
+    uint32_t i = 0;
+    while (i < len) {
+        if (src[i] == base[i]) {
+            i++;
+            continue;
+        }
+        
+        // extend the range until we see a stretch of equal bytes longer than a new entry would cost
+        uint32_t start = i;
+        uint32_t end = i + 1;
+        uint32_t scan = end;
+        while (scan < len && scan - end <= PATCH_ENTRY_HEADER) {
+            if (src[scan] != base[scan]) {end = scan + 1;}
+            scan++;
+        }
+        
+        uint32_t count = end - start;
+        if (out + PATCH_ENTRY_HEADER + count > capacity) {return 0;}
+        
+        put_u16(dst + out, start);
+        put_u16(dst + out + 2, count);
+        memcpy(dst + out + PATCH_ENTRY_HEADER, src + start, count);
+        out += PATCH_ENTRY_HEADER + count;
+        
+        i = end;
+    }
+    
+    return out;
+}
@@ -0,0 +1,16 @@
+#ifndef PATCH_H
+#define PATCH_H
+
+#include "stdint.h"
+
+// field level diff of two buffers of the same length
+// [base sequence u32] then any number of [offset u16][length u16][length bytes], little endian.
+// ranges closer together than a patch header are merged
+
+#define PATCH_PREFIX_SIZE 4
+#define PATCH_ENTRY_HEADER 4
+
+// returns the encoded length, or 0 if it doesn't fit in capacity
+uint32_t patch_encode(const uint8_t *src, const uint8_t *base, uint32_t len, uint32_t base_sequence, uint8_t *dst, uint32_t capacity);
+
+#endif
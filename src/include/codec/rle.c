@@ -0,0 +1,115 @@
+#include "rle.h"
+
+enum {
+    RLE_EXPECT_CONTROL,
+    RLE_IN_LITERAL,
+    RLE_EXPECT_RUN_BYTE
+};
+
+static uint8_t source_byte(const uint8_t *src, const uint8_t *base, uint32_t i) {
+    return base ? (uint8_t)(src[i] ^ base[i]) : src[i];
+}
+
+// writes src[start, end) as one or more literal controls
+static uint32_t emit_literals(const uint8_t *src, const uint8_t *base, uint32_t start, uint32_t end, uint8_t *dst, uint32_t out, uint32_t capacity) {
+    while (start < end) {
+        uint32_t count = end - start;
+        if (count > RLE_MAX_LITERAL) {count = RLE_MAX_LITERAL;}
+        if (out + 1 + count > capacity) {return 0;}
+        
+        dst[out++] = (uint8_t)(count - 1);
+        for (uint32_t i = 0; i < count; i++) {dst[out++] = source_byte(src, base, start + i);}
+        start += count;
+    }
+    return out;
+}
+
+uint32_t rle_encode(const uint8_t *src, const uint8_t *base, uint32_t len, uint8_t *dst, uint32_t capacity) {
+    uint32_t out = 0;
+    uint32_t literal_start = 0;
+    uint32_t i = 0;
+    
+    while (i < len) {
+        uint8_t value = source_byte(src, base, i);
+        uint32_t run = 1;
+        while (i + run < len && run < RLE_MAX_RUN && source_byte(src, base, i + run) == value) {run++;}
+        
+        if (run < RLE_MIN_RUN) {
+            i += run;
+            continue;
+        }
+        
+        if (literal_start < i) {
+            out = emit_literals(src, base, literal_start, i, dst, out, capacity);
+            if (out == 0) {return 0;}
+        }
+        
+        if (out + 2 > capacity) {return 0;}
+        dst[out++] = (uint8_t)(run + 125);
+        dst[out++] = value;
+        
+        i += run;
+        literal_start = i;
+    }
+    
+    if (literal_start < len) {
+        out = emit_literals(src, base, literal_start, len, dst, out, capacity);
+    }
+    
+    return out;
+}
+
+void rle_decoder_init(rle_decoder *decoder, uint8_t *dst, uint32_t capacity, int xor_output) {
+    decoder->dst = dst;
+    decoder->capacity = capacity;
+    decoder->length = 0;
+    decoder->remaining = 0;
+    decoder->mode = RLE_EXPECT_CONTROL;
+    decoder->xor_output = xor_output ? 1 : 0;
+}
+
+static void put_byte(rle_decoder *decoder, uint8_t value) {
+    if (decoder->xor_output) {
+        decoder->dst[decoder->length++] ^= value;
+    } else {
+        decoder->dst[decoder->length++] = value;
+    }
+}
+
+int rle_decoder_feed(rle_decoder *decoder, const uint8_t *src, uint32_t len) {
+    for (uint32_t i = 0; i < len; i++) {
+        uint8_t byte = src[i];
+        
+        switch (decoder->mode) {
+            case RLE_EXPECT_CONTROL:
+                if (byte < RLE_MAX_LITERAL) {
+                    decoder->remaining = (uint32_t)byte + 1;
+                    decoder->mode = RLE_IN_LITERAL;
+                } else {
+                    decoder->remaining = (uint32_t)byte - 125;
+                    decoder->mode = RLE_EXPECT_RUN_BYTE;
+                }
+                break;
+                
+            case RLE_IN_LITERAL:
+                if (decoder->length >= decoder->capacity) {return -1;}
+                put_byte(decoder, byte);
+                if (--decoder->remaining == 0) {decoder->mode = RLE_EXPECT_CONTROL;}
+                break;
+                
+            case RLE_EXPECT_RUN_BYTE:
+                if (decoder->remaining > decoder->capacity - decoder->length) {return -1;}
+                while (decoder->remaining > 0) {
+                    put_byte(decoder, byte);
+                    decoder->remaining--;
+                }
+                decoder->mode = RLE_EXPECT_CONTROL;
+                break;
+        }
+    }
+    return 0;
+}
+
+int rle_decoder_done(const rle_decoder *decoder) {
+    return decoder->mode == RLE_EXPECT_CONTROL;
+}
@@ -0,0 +1,39 @@
+#ifndef RLE_H
+#define RLE_H
+
+#include "stdint.h"
+
+// PackBits style byte run length coding.
+// control byte n < 128: n + 1 literal bytes follow
+// control byte n >= 128: the next byte is repeated n - 125 times (3 - 130)
+//
+// both directions can optionally xor against a base buffer of the same length, which turns
+// a record that only changed slightly into long runs of zeros
+
+#define RLE_MAX_LITERAL 128
+#define RLE_MIN_RUN 3
+#define RLE_MAX_RUN 130
+
+// encodes len bytes of src (xor base when base isn't NULL) into dst.
+// returns the encoded length, or 0 if it doesn't fit in capacity
+uint32_t rle_encode(const uint8_t *src, const uint8_t *base, uint32_t len, uint8_t *dst, uint32_t capacity);
+
+// streaming decoder so encoded records can be fed straight from flash in CRC_CHUNK pieces
+typedef struct {
+    uint8_t *dst;
+    uint32_t capacity;
+    uint32_t length;     // bytes produced so far
+    uint32_t remaining;  // literal bytes left in the current control, or run length waiting for its byte
+    uint8_t mode;        // see rle.c
+    uint8_t xor_output;  // xor into dst instead of overwriting it
+} rle_decoder;
+
+void rle_decoder_init(rle_decoder *decoder, uint8_t *dst, uint32_t capacity, int xor_output);
+
+// returns 0 on success, -1 if the output would overflow capacity
+int rle_decoder_feed(rle_decoder *decoder, const uint8_t *src, uint32_t len);
+
+// returns 1 when the stream ended on a control boundary
+int rle_decoder_done(const rle_decoder *decoder);
+
+#endif
@@ -0,0 +1,74 @@
+#include "crc32c.h"
+#include "crc.h"
+
+#include <string.h>
+
+// use the crc32c instruction when the target has one. on x86 with gcc or clang the SSE4.2
+// version is always compiled and picked at runtime from cpuid, so the default build gets it
+// on any machine that has it. arm only has the compile time path (-march=armv8-a+crc), the
+// firmware toolchain knows what core it targets. everything else uses the table
+#if defined(__SSE4_2__)
+#include <nmmintrin.h>
+#define CRC32C_SSE42 1
+#elif (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#include <nmmintrin.h>
+#define CRC32C_SSE42 1
+#define CRC32C_SSE42_RUNTIME 1
+#elif defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+
+uint32_t crc32c_table_byte_seq(uint32_t crc, const uint8_t *p, uint32_t len) {
+    while (len--) {crc = poly8_lookup_c[(uint8_t)(crc ^ *p++)] ^ (crc >> 8);}
+    return crc;
+}
+
+#ifdef CRC32C_SSE42
+#ifdef CRC32C_SSE42_RUNTIME
+__attribute__((target("sse4.2")))
+#endif
+static uint32_t sse42_byte_seq(uint32_t crc, const uint8_t *p, uint32_t len) {
+    while (len >= sizeof(uint32_t)) {
+        uint32_t word;
+        memcpy(&word, p, sizeof(uint32_t));
+        crc = _mm_crc32_u32(crc, word);
+        p += sizeof(uint32_t);
+        len -= sizeof(uint32_t);
+    }
+    while (len--) {crc = _mm_crc32_u8(crc, *p++);}
+    return crc;
+}
+#endif
+
+int crc32c_hardware() {
+#if defined(CRC32C_SSE42_RUNTIME)
+    return __builtin_cpu_supports("sse4.2");
+#elif defined(CRC32C_SSE42) || defined(__ARM_FEATURE_CRC32)
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+uint32_t crc32c_byte_seq(uint32_t crc, const uint8_t *p, uint32_t len) {
+#if defined(CRC32C_SSE42)
+    if (crc32c_hardware()) {return sse42_byte_seq(crc, p, len);}
+    return crc32c_table_byte_seq(crc, p, len);
+#elif defined(__ARM_FEATURE_CRC32)
+    while (len >= sizeof(uint32_t)) {
+        uint32_t word;
+        memcpy(&word, p, sizeof(uint32_t));
+        crc = __crc32cw(crc, word);
+        p += sizeof(uint32_t);
+        len -= sizeof(uint32_t);
+    }
+    while (len--) {crc = __crc32cb(crc, *p++);}
+    return crc;
+#else
+    return crc32c_table_byte_seq(crc, p, len);
+#endif
+}
+
+uint32_t crc32c_byte(const uint8_t *p, uint32_t len) {
+    return crc32_finalize(crc32c_byte_seq(start_crc, p, len));
+}
@@ -12,7 +12,8 @@ typedef enum {
     ERR_UNINITIALIZED,
     ERR_NULL_PTR,
     ERR_NO_COMMIT,
-    ERR_NO_RECORD
+    ERR_NO_RECORD,
+    ERR_UNSUPPORTED
 } flash_error;
 
 typedef enum {
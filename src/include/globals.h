@@ -3,12 +3,16 @@
 
 #include "stdint.h"
 
-#define CRC_CHUNK 512 // used for limiting stack usage when streaming in bytes for crc checking
+#define CRC_CHUNK 512 // used for limiting stack usage when streaming in bytes for crc checking. keep it a multiple of 4 (INTEGRITY_FAST32)
 #define SECTOR_SIZE 4096 // the size of the sectors in flash
 #define FLASH_ALIGN 4 // esp often enforces a byte align for writing
+#define FLASH_PAGE_SIZE 256 // program page of most NOR parts, the natural size for the write buffer
 #define PARTITION_SIZE 65536 // our custom flash partition size 
 
-static const uint32_t HEADER_MAGIC = 0x4D474943; // ascii MGIC
+// bumped whenever record_header changes shape. MGIC is the original 20 byte header without
+// flags and timestamp, mount refuses partitions written with it instead of wiping them
+static const uint32_t HEADER_MAGIC = 0x4D474332; // ascii MGC2
+static const uint32_t LEGACY_HEADER_MAGIC = 0x4D474943; // ascii MGIC
 static const uint32_t COMMIT_MAGIC = 0x434D4954; // ascii CMIT
 
 #endif
\ No newline at end of file
@@ -0,0 +1,81 @@
+#include "integrity.h"
+#include "../crc/crc.h"
+#include "../crc/crc32c.h"
+
+#include <string.h>
+
+static const uint32_t fast32_seed = 0x9747B28Cu;
+
+int integrity_is_known(uint32_t kind) {
+    return kind < INTEGRITY_COUNT;
+}
+
+static uint32_t rotl32(uint32_t x, uint8_t r) {
+    return (x << r) | (x >> (32 - r));
+}
+
+static uint32_t fast32_mix(uint32_t k) {
+    k *= 0xCC9E2D51u;
+    k = rotl32(k, 15);
+    return k * 0x1B873593u;
+}
+
+static uint32_t fast32_seq(uint32_t h, const uint8_t *p, uint32_t len) {
+    while (len >= sizeof(uint32_t)) {
+        uint32_t k;
+        memcpy(&k, p, sizeof(uint32_t));
+        h ^= fast32_mix(k);
+        h = rotl32(h, 13) * 5 + 0xE6546B64u;
+        p += sizeof(uint32_t);
+        len -= sizeof(uint32_t);
+    }
+    
+    // tail bytes, only reached on the final call
+    uint32_t k = 0;
+    switch (len) {
+        case 3: k ^= (uint32_t)p[2] << 16; // fall through
+        case 2: k ^= (uint32_t)p[1] << 8;  // fall through
+        case 1: k ^= p[0]; h ^= fast32_mix(k);
+    }
+    return h;
+}
+
+static uint32_t fast32_finalize(uint32_t h) {
+    h ^= h >> 16;
+    h *= 0x85EBCA6Bu;
+    h ^= h >> 13;
+    h *= 0xC2B2AE35u;
+    h ^= h >> 16;
+    return h;
+}
+
+uint32_t integrity_start(uint32_t kind) {
+    switch (kind) {
+        case INTEGRITY_CRC32:
+        case INTEGRITY_CRC32C: return start_crc;
+        case INTEGRITY_FAST32: return fast32_seed;
+        default: return 0;
+    }
+}
+
+uint32_t integrity_update(uint32_t kind, uint32_t state, const uint8_t *p, uint32_t len) {
+    switch (kind) {
+        case INTEGRITY_CRC32: return crc32_byte_seq(state, p, len);
+        case INTEGRITY_CRC32C: return crc32c_byte_seq(state, p, len);
+        case INTEGRITY_FAST32: return fast32_seq(state, p, len);
+        default: return state;
+    }
+}
+
+uint32_t integrity_finalize(uint32_t kind, uint32_t state) {
+    switch (kind) {
+        case INTEGRITY_CRC32:
+        case INTEGRITY_CRC32C: return crc32_finalize(state);
+        case INTEGRITY_FAST32: return fast32_finalize(state);
+        default: return 0;
+    }
+}
+
+uint32_t integrity_compute(uint32_t kind, const uint8_t *p, uint32_t len) {
+    return integrity_finalize(kind, integrity_update(kind, integrity_start(kind), p, len));
+}
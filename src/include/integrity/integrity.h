@@ -0,0 +1,26 @@
+#ifndef INTEGRITY_H
+#define INTEGRITY_H
+
+#include "stdint.h"
+
+// the payload check a record was written with. stored in the low bits of record_header.flags
+// so mount and read can pick the matching verifier per record
+typedef enum {
+    INTEGRITY_CRC32,        // table crc32, the original format
+    INTEGRITY_CRC32C,       // castagnoli, uses the hardware instruction when the target has one
+    INTEGRITY_FAST32,       // murmur3 style word hash, much cheaper than a table crc but weaker
+    INTEGRITY_HEADER_ONLY,  // no payload check, for media that already has ECC
+    INTEGRITY_COUNT
+} integrity_kind;
+
+int integrity_is_known(uint32_t kind);
+
+// streaming interface, mirrors crc32_byte_seq / crc32_finalize.
+// for INTEGRITY_FAST32 every call except the last has to be a multiple of 4 bytes long
+uint32_t integrity_start(uint32_t kind);
+uint32_t integrity_update(uint32_t kind, uint32_t state, const uint8_t *p, uint32_t len);
+uint32_t integrity_finalize(uint32_t kind, uint32_t state);
+
+uint32_t integrity_compute(uint32_t kind, const uint8_t *p, uint32_t len);
+
+#endif
@@ -9,12 +9,17 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
-const char* file_path = "flash.bin";
+typedef struct {
+    const char *file_path;
+    uint8_t *memory;
+    uint32_t program_us;
+    uint32_t erase_us;
+} sim_device;
 
-uint8_t *memory = NULL;
-
-FILE *file;
+// instance 0 is the one behind init/deinit/write/read/erase and g_flash_hal
+static sim_device devices[SIM_MAX_INSTANCES] = {{.file_path = "flash.bin"}};
 
 flash_hal_t g_flash_hal = (flash_hal_t){
     .init = &init,
@@ -24,6 +29,26 @@ flash_hal_t g_flash_hal = (flash_hal_t){
     .erase = &erase
 };
 
+void sim_set_file_path(const char *path) {
+    sim_set_instance_file_path(0, path);
+}
+
+void sim_set_instance_file_path(uint32_t instance, const char *path) {
+    if (path && instance < SIM_MAX_INSTANCES) {devices[instance].file_path = path;}
+}
+
+void sim_set_latency(uint32_t instance, uint32_t program_us, uint32_t erase_us) {
+    if (instance >= SIM_MAX_INSTANCES) {return;}
+    devices[instance].program_us = program_us;
+    devices[instance].erase_us = erase_us;
+}
+
+static void busy_for(uint32_t us) {
+    if (us == 0) {return;}
+    struct timespec ts = {us / 1000000, (us % 1000000) * 1000};
+    nanosleep(&ts, NULL);
+}
+
 long get_file_size(FILE *file) {
     if (file == NULL) {return 0;}
     fseek(file, 0, SEEK_END);
@@ -32,11 +57,17 @@ long get_file_size(FILE *file) {
     return size;
 }
 
-int init() {
-    memory = (uint8_t *)malloc(PARTITION_SIZE);
+int sim_instance_init(uint32_t instance) {
+    if (instance >= SIM_MAX_INSTANCES) {return -1;}
+    sim_device *device = &devices[instance];
+    const char *file_path = device->file_path;
+    FILE *file;
+    
+    uint8_t *memory = (uint8_t *)malloc(PARTITION_SIZE);
     if (!memory) {return -1;}
     
     memset(memory, 0xFF, PARTITION_SIZE);
+    device->memory = memory;
     
     // load the simulated flash file
     file = fopen(file_path, "rb");
@@ -50,7 +81,7 @@ int init() {
         debug_print("Opening existing flash file\n");
         long size = get_file_size(file);
         size_t bytes = fread(memory, 1, min(size, PARTITION_SIZE), file); // read the file into our memory struct
-        if (bytes != size) {return -1;} // EOF or error
+        if (bytes != size) {fclose(file); return -1;} // EOF or error
         if (bytes != PARTITION_SIZE) {debug_print("Flash file smaller than memory, results may differ\n");}
         // bug with file loading so this is temp debug
         // TEMP
@@ -65,10 +96,16 @@ int init() {
 }
 
 int initialized() {
-    return (memory != NULL);
+    return (devices[0].memory != NULL);
 }
 
-void deinit() {
+void sim_instance_deinit(uint32_t instance) {
+    if (instance >= SIM_MAX_INSTANCES) {return;}
+    sim_device *device = &devices[instance];
+    uint8_t *memory = device->memory;
+    const char *file_path = device->file_path;
+    FILE *file;
+    
     if (memory) {
         file = fopen(file_path, "wb");
         if (file) {
@@ -80,13 +117,13 @@ void deinit() {
             debug_print("Error saving file\n");
         }
         free(memory);
-        memory = NULL;
+        device->memory = NULL;
     }
 }
 
-
-flash_error write(uint32_t addr, const void *ptr, uint32_t len) {
-    if (!initialized()) {return ERR_UNINITIALIZED;}
+flash_error sim_instance_write(uint32_t instance, uint32_t addr, const void *ptr, uint32_t len) {
+    if (instance >= SIM_MAX_INSTANCES || devices[instance].memory == NULL) {return ERR_UNINITIALIZED;}
+    uint8_t *memory = devices[instance].memory;
     
     //debug_print("Byte 0: %u\n", memory[0]);
     
@@ -126,11 +163,13 @@ flash_error write(uint32_t addr, const void *ptr, uint32_t len) {
         memory[addr + len + bytes_left] = 0xFF;
     }
     
+    busy_for(devices[instance].program_us * ((len + FLASH_PAGE_SIZE - 1) / FLASH_PAGE_SIZE));
     return ERR_SUCCESS;
 }
 
-flash_error read(uint32_t addr, void *ptr, uint32_t len) {
-    if (!initialized()) {return ERR_UNINITIALIZED;}
+flash_error sim_instance_read(uint32_t instance, uint32_t addr, void *ptr, uint32_t len) {
+    if (instance >= SIM_MAX_INSTANCES || devices[instance].memory == NULL) {return ERR_UNINITIALIZED;}
+    uint8_t *memory = devices[instance].memory;
     
     if (len == 0) {return ERR_INVALID_ALIGN;}
     
@@ -149,14 +188,49 @@ flash_error read(uint32_t addr, void *ptr, uint32_t len) {
     return ERR_SUCCESS;
 }
 
-flash_error erase(uint32_t sector) {
-    if (!initialized()) {return ERR_UNINITIALIZED;}
-    if (sector > (PARTITION_SIZE / SECTOR_SIZE)) {
+flash_error sim_instance_erase(uint32_t instance, uint32_t sector) {
+    if (instance >= SIM_MAX_INSTANCES || devices[instance].memory == NULL) {return ERR_UNINITIALIZED;}
+    uint8_t *memory = devices[instance].memory;
+    if (sector >= (PARTITION_SIZE / SECTOR_SIZE)) {
         return ERR_OUT_OF_BOUNDS;
     }
     
     uint32_t start = sector * SECTOR_SIZE;
     
     memset(&memory[start], 0, SECTOR_SIZE);
+    busy_for(devices[instance].erase_us);
     return ERR_SUCCESS;
+}
+
+int init() {return sim_instance_init(0);}
+void deinit() {sim_instance_deinit(0);}
+flash_error write(uint32_t addr, const void *ptr, uint32_t len) {return sim_instance_write(0, addr, ptr, len);}
+flash_error read(uint32_t addr, void *ptr, uint32_t len) {return sim_instance_read(0, addr, ptr, len);}
+flash_error erase(uint32_t sector) {return sim_instance_erase(0, sector);}
+
+// a flash_hal_t per instance for code that takes HAL tables, like the stripe HAL
+#define SIM_INSTANCE_HAL(n) \
+    static int init_##n() {return sim_instance_init(n);} \
+    static void deinit_##n() {sim_instance_deinit(n);} \
+    static flash_error write_##n(uint32_t addr, const void *ptr, uint32_t len) {return sim_instance_write(n, addr, ptr, len);} \
+    static flash_error read_##n(uint32_t addr, void *ptr, uint32_t len) {return sim_instance_read(n, addr, ptr, len);} \
+    static flash_error erase_##n(uint32_t sector) {return sim_instance_erase(n, sector);}
+
+SIM_INSTANCE_HAL(0)
+SIM_INSTANCE_HAL(1)
+SIM_INSTANCE_HAL(2)
+SIM_INSTANCE_HAL(3)
+
+#define SIM_INSTANCE_TABLE(n) {.init = &init_##n, .deinit = &deinit_##n, .write = &write_##n, .read = &read_##n, .erase = &erase_##n}
+
+static const flash_hal_t instance_hals[SIM_MAX_INSTANCES] = {
+    SIM_INSTANCE_TABLE(0),
+    SIM_INSTANCE_TABLE(1),
+    SIM_INSTANCE_TABLE(2),
+    SIM_INSTANCE_TABLE(3)
+};
+
+flash_hal_t sim_instance_hal(uint32_t instance) {
+    if (instance >= SIM_MAX_INSTANCES) {return (flash_hal_t){0};}
+    return instance_hals[instance];
 }
\ No newline at end of file
@@ -4,6 +4,30 @@
 #include "../include/errors.h"
 #include "stdint.h"
 
+#include "../hal/flash_hal.h"
+
+// how many simulated chips can exist at once. instance 0 is the default one behind
+// init/deinit/write/read/erase and g_flash_hal
+#define SIM_MAX_INSTANCES 4
+
+// where the simulated flash is loaded from and saved to, "flash.bin" by default.
+// has to be called before init
+void sim_set_file_path(const char *path);
+void sim_set_instance_file_path(uint32_t instance, const char *path);
+
+// makes the instance take program_us per started FLASH_PAGE_SIZE page and erase_us per
+// sector erase, so timing of multi chip setups can be looked at. 0 (the default) is instant
+void sim_set_latency(uint32_t instance, uint32_t program_us, uint32_t erase_us);
+
+// a HAL table for one instance
+flash_hal_t sim_instance_hal(uint32_t instance);
+
+int sim_instance_init(uint32_t instance);
+void sim_instance_deinit(uint32_t instance);
+flash_error sim_instance_write(uint32_t instance, uint32_t addr, const void *ptr, uint32_t len);
+flash_error sim_instance_read(uint32_t instance, uint32_t addr, void *ptr, uint32_t len);
+flash_error sim_instance_erase(uint32_t instance, uint32_t sector);
+
 int init();
 void deinit();
 
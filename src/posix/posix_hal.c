@@ -0,0 +1,361 @@
+#define _GNU_SOURCE
+
+#include "posix_hal.h"
+#include "../include/globals.h"
+#include "../include/utils/utils.h"
+#include "../hal/flash_hal.h"
+#include "../include/debug/debug.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/falloc.h>
+#include <linux/fs.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#ifdef FLASHLOG_CONCURRENT
+#include <pthread.h>
+#endif
+
+#define POSIX_DIRECT_ALIGN 4096 // covers the logical block size of everything we run on
+#define POSIX_BOUNCE_SIZE (SECTOR_SIZE + 2 * POSIX_DIRECT_ALIGN)
+#define POSIX_MAX_SEGMENTS 8
+
+static posix_hal_config config = {
+    .path = "flash.img",
+    .direct = 0,
+    .punch_erase = 0,
+    .barrier_commit = 0
+};
+
+static int fd = -1;
+static uint8_t *bounce = NULL; // only used with O_DIRECT
+
+#ifdef FLASHLOG_CONCURRENT
+// readers and the scrub threads come through direct_io next to the writer, there's one bounce
+// buffer and a read-modify-write must not interleave with anything else on the same blocks
+static pthread_mutex_t bounce_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static const uint8_t erased_bytes[FLASH_ALIGN] = {0xFF, 0xFF, 0xFF, 0xFF};
+
+void posix_hal_configure(const posix_hal_config *new_config) {
+    if (new_config == NULL) {return;}
+    config = *new_config;
+    if (config.path == NULL) {config.path = "flash.img";}
+}
+
+// plain positional io that retries short transfers
+static flash_error full_pread(void *ptr, size_t len, off_t offset) {
+    uint8_t *bytes = (uint8_t*)ptr;
+    while (len > 0) {
+        ssize_t done = pread(fd, bytes, len, offset);
+        if (done < 0 && errno == EINTR) {continue;}
+        if (done <= 0) {return ERR_FAIL;}
+        bytes += done;
+        len -= done;
+        offset += done;
+    }
+    return ERR_SUCCESS;
+}
+
+static flash_error full_pwrite(const void *ptr, size_t len, off_t offset) {
+    const uint8_t *bytes = (const uint8_t*)ptr;
+    while (len > 0) {
+        ssize_t done = pwrite(fd, bytes, len, offset);
+        if (done < 0 && errno == EINTR) {continue;}
+        if (done <= 0) {return ERR_FAIL;}
+        bytes += done;
+        len -= done;
+        offset += done;
+    }
+    return ERR_SUCCESS;
+}
+
+// O_DIRECT needs aligned offsets, lengths and buffers, so every access is widened to whole
+// blocks in the bounce buffer. writes are read-modify-write of the surrounding blocks
+static flash_error direct_io_locked(uint32_t addr, void *ptr, uint32_t len, int is_write) {
+    uint8_t *bytes = (uint8_t*)ptr;
+    
+    while (len > 0) {
+        uint32_t start = round_down(addr, POSIX_DIRECT_ALIGN);
+        uint32_t offset = addr - start;
+        uint32_t count = min(len, SECTOR_SIZE);
+        uint32_t span = round_up(offset + count, POSIX_DIRECT_ALIGN);
+        
+        flash_error error = full_pread(bounce, span, start);
+        if (error != ERR_SUCCESS) {return error;}
+        
+        if (is_write) {
+            memcpy(bounce + offset, bytes, count);
+            error = full_pwrite(bounce, span, start);
+            if (error != ERR_SUCCESS) {return error;}
+        } else {
+            memcpy(bytes, bounce + offset, count);
+        }
+        
+        addr += count;
+        bytes += count;
+        len -= count;
+    }
+    
+    return ERR_SUCCESS;
+}
+
+static flash_error direct_io(uint32_t addr, void *ptr, uint32_t len, int is_write) {
+#ifdef FLASHLOG_CONCURRENT
+    pthread_mutex_lock(&bounce_lock);
+    flash_error error = direct_io_locked(addr, ptr, len, is_write);
+    pthread_mutex_unlock(&bounce_lock);
+    return error;
+#else
+    return direct_io_locked(addr, ptr, len, is_write);
+#endif
+}
+
+static flash_error raw_write(uint32_t addr, const void *ptr, uint32_t len) {
+    if (config.direct) {return direct_io(addr, (void*)ptr, len, 1);}
+    return full_pwrite(ptr, len, addr);
+}
+
+static flash_error raw_read(uint32_t addr, void *ptr, uint32_t len) {
+    if (config.direct) {return direct_io(addr, ptr, len, 0);}
+    return full_pread(ptr, len, addr);
+}
+
+static flash_error fill_erased(uint32_t addr, uint32_t len) {
+    uint8_t block[512];
+    memset(block, 0xFF, sizeof(block));
+    
+    while (len > 0) {
+        uint32_t count = min(len, sizeof(block));
+        flash_error error = raw_write(addr, block, count);
+        if (error != ERR_SUCCESS) {return error;}
+        addr += count;
+        len -= count;
+    }
+    return ERR_SUCCESS;
+}
+
+// every failure after the open goes through here so nothing is left open or allocated
+static int abort_init() {
+    close(fd);
+    fd = -1;
+    free(bounce);
+    bounce = NULL;
+    return -1;
+}
+
+static int posix_init() {
+    int flags = O_RDWR | O_CREAT;
+    if (config.direct) {flags |= O_DIRECT;}
+    
+    fd = open(config.path, flags, 0644);
+    if (fd < 0) {
+        debug_print("Error opening %s: %i\n", config.path, errno);
+        return -1;
+    }
+    
+    if (config.direct && posix_memalign((void**)&bounce, POSIX_DIRECT_ALIGN, POSIX_BOUNCE_SIZE) != 0) {
+        bounce = NULL;
+        return abort_init();
+    }
+    
+    struct stat info;
+    if (fstat(fd, &info) != 0) {return abort_init();}
+    
+    if (S_ISBLK(info.st_mode)) {
+        uint64_t device_size = 0;
+        if (ioctl(fd, BLKGETSIZE64, &device_size) != 0 || device_size < PARTITION_SIZE) {
+            debug_print("Block device %s is smaller than the partition\n", config.path);
+            return abort_init();
+        }
+    } else if (info.st_size < PARTITION_SIZE) {
+        // a new (or short) image starts out erased
+        debug_print("Extending %s to the partition size\n", config.path);
+        uint32_t existing = (uint32_t)info.st_size;
+        if (ftruncate(fd, PARTITION_SIZE) != 0) {return abort_init();}
+        if (fill_erased(existing, PARTITION_SIZE - existing) != ERR_SUCCESS) {return abort_init();}
+    }
+    
+    return 0;
+}
+
+static void posix_deinit() {
+    if (fd >= 0) {
+        fdatasync(fd);
+        close(fd);
+        fd = -1;
+    }
+    free(bounce);
+    bounce = NULL;
+}
+
+static flash_error check_range(uint32_t addr, uint32_t len) {
+    if (fd < 0) {return ERR_UNINITIALIZED;}
+    if (len == 0) {return ERR_INVALID_ALIGN;}
+    if (addr > PARTITION_SIZE || round_up(len, FLASH_ALIGN) > PARTITION_SIZE - addr) {return ERR_OUT_OF_BOUNDS;}
+    return ERR_SUCCESS;
+}
+
+static flash_error posix_write(uint32_t addr, const void *ptr, uint32_t len) {
+    flash_error error = check_range(addr, len);
+    if (error != ERR_SUCCESS) {return error;}
+    if (addr % FLASH_ALIGN != 0) {return ERR_INVALID_ALIGN;}
+    if (ptr == NULL) {return ERR_NULL_PTR;}
+    
+    error = raw_write(addr, ptr, len);
+    if (error != ERR_SUCCESS) {return error;}
+    
+    // pad like the sim does so the image matches what real hardware would hold
+    uint32_t padding = round_up(len, FLASH_ALIGN) - len;
+    if (padding > 0) {error = raw_write(addr + len, erased_bytes, padding);}
+    
+    return error;
+}
+
+static flash_error posix_read(uint32_t addr, void *ptr, uint32_t len) {
+    if (fd < 0) {return ERR_UNINITIALIZED;}
+    if (len == 0) {return ERR_INVALID_ALIGN;}
+    if (addr + len > PARTITION_SIZE) {return ERR_OUT_OF_BOUNDS;}
+    if (ptr == NULL) {return ERR_NULL_PTR;}
+    
+    return raw_read(addr, ptr, len);
+}
+
+static flash_error posix_erase(uint32_t sector) {
+    if (fd < 0) {return ERR_UNINITIALIZED;}
+    if (sector >= PARTITION_SIZE / SECTOR_SIZE) {return ERR_OUT_OF_BOUNDS;}
+    
+    uint32_t start = sector * SECTOR_SIZE;
+    
+    if (config.punch_erase) {
+        if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, start, SECTOR_SIZE) == 0) {return ERR_SUCCESS;}
+        debug_print("Punching sector %u failed (%i), filling instead\n", sector, errno);
+    }
+    
+    return fill_erased(start, SECTOR_SIZE);
+}
+
+static flash_error posix_sync() {
+    if (fd < 0) {return ERR_UNINITIALIZED;}
+    return fdatasync(fd) == 0 ? ERR_SUCCESS : ERR_FAIL;
+}
+
+// turns the segments into one iovec list over a contiguous range, padding any gaps with erased
+// bytes. returns the number of iovecs or 0 if the segments aren't ordered and close together
+static int gather_segments(const flash_write_segment *segments, uint32_t count, struct iovec *iov, uint32_t *total) {
+    int used = 0;
+    uint32_t end = segments[0].addr;
+    *total = 0;
+    
+    for (uint32_t i = 0; i < count; i++) {
+        if (segments[i].addr < end || segments[i].addr - end > FLASH_ALIGN) {return 0;}
+        
+        if (segments[i].addr > end) {
+            iov[used].iov_base = (void*)erased_bytes;
+            iov[used].iov_len = segments[i].addr - end;
+            *total += iov[used].iov_len;
+            used++;
+        }
+        
+        iov[used].iov_base = (void*)segments[i].ptr;
+        iov[used].iov_len = segments[i].len;
+        *total += segments[i].len;
+        used++;
+        
+        end = segments[i].addr + segments[i].len;
+    }
+    
+    return used;
+}
+
+static flash_error write_iov(const struct iovec *iov, int count, uint32_t addr, uint32_t total) {
+    if (config.direct) {
+        // O_DIRECT can't take the caller's buffers, go through the bounce buffer one piece at a time
+        for (int i = 0; i < count; i++) {
+            flash_error error = direct_io(addr, iov[i].iov_base, iov[i].iov_len, 1);
+            if (error != ERR_SUCCESS) {return error;}
+            addr += iov[i].iov_len;
+        }
+        return ERR_SUCCESS;
+    }
+    
+    ssize_t done = pwritev(fd, iov, count, addr);
+    if (done == (ssize_t)total) {return ERR_SUCCESS;}
+    
+    // short or interrupted, finish it piece by piece
+    for (int i = 0; i < count; i++) {
+        flash_error error = full_pwrite(iov[i].iov_base, iov[i].iov_len, addr);
+        if (error != ERR_SUCCESS) {return error;}
+        addr += iov[i].iov_len;
+    }
+    return ERR_SUCCESS;
+}
+
+static flash_error posix_write_batch(const flash_write_segment *segments, uint32_t count) {
+    if (segments == NULL) {return ERR_NULL_PTR;}
+    if (count == 0 || count > POSIX_MAX_SEGMENTS) {return ERR_INVALID_ARGUMENT;}
+    
+    const flash_write_segment *last = &segments[count - 1];
+    uint32_t end = last->addr + round_up(last->len, FLASH_ALIGN);
+    
+    flash_error error = check_range(segments[0].addr, end - segments[0].addr);
+    if (error != ERR_SUCCESS) {return error;}
+    if (segments[0].addr % FLASH_ALIGN != 0) {return ERR_INVALID_ALIGN;}
+    
+    // body is everything but the commit word, which goes out last (with padding to FLASH_ALIGN)
+    struct iovec body[POSIX_MAX_SEGMENTS * 2];
+    uint32_t body_total = 0;
+    int body_count = count > 1 ? gather_segments(segments, count - 1, body, &body_total) : 0;
+    
+    if (count > 1 && body_count == 0) {
+        // not one contiguous range, just do them one by one
+        for (uint32_t i = 0; i < count; i++) {
+            error = posix_write(segments[i].addr, segments[i].ptr, segments[i].len);
+            if (error != ERR_SUCCESS) {return error;}
+        }
+        return ERR_SUCCESS;
+    }
+    
+    // padding between the body and the commit word
+    uint32_t body_end = segments[0].addr + body_total;
+    if (body_count > 0 && last->addr > body_end) {
+        if (last->addr - body_end > FLASH_ALIGN) {return ERR_INVALID_ARGUMENT;}
+        body[body_count].iov_base = (void*)erased_bytes;
+        body[body_count].iov_len = last->addr - body_end;
+        body_total += body[body_count].iov_len;
+        body_count++;
+    }
+    
+    uint8_t commit_bytes[4 * FLASH_ALIGN];
+    uint32_t commit_len = round_up(last->len, FLASH_ALIGN);
+    if (commit_len > sizeof(commit_bytes)) {return posix_write(last->addr, last->ptr, last->len);}
+    memset(commit_bytes, 0xFF, commit_len);
+    memcpy(commit_bytes, last->ptr, last->len);
+    struct iovec commit = {commit_bytes, commit_len};
+    
+    if (body_count > 0) {
+        error = write_iov(body, body_count, segments[0].addr, body_total);
+        if (error != ERR_SUCCESS) {return error;}
+        
+        if (config.barrier_commit && fdatasync(fd) != 0) {return ERR_FAIL;}
+    }
+    
+    return write_iov(&commit, 1, last->addr, commit_len);
+}
+
+flash_hal_t g_flash_hal = (flash_hal_t){
+    .init = &posix_init,
+    .deinit = &posix_deinit,
+    .write = &posix_write,
+    .read = &posix_read,
+    .erase = &posix_erase,
+    .sync = &posix_sync,
+    .write_batch = &posix_write_batch
+};
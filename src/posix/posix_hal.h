@@ -0,0 +1,19 @@
+#ifndef POSIX_HAL_H
+#define POSIX_HAL_H
+
+#include "../include/errors.h"
+#include "stdint.h"
+
+// flash_hal_t backend for hosted Linux, keeps the partition in a regular file or on a raw
+// block device. the first PARTITION_SIZE bytes are used
+typedef struct {
+    const char *path;    // file or block device, defaults to "flash.img"
+    int direct;          // open with O_DIRECT, all io goes through an aligned bounce buffer, one access at a time
+    int punch_erase;     // erase by punching a hole (reads back 0x00) instead of filling with 0xFF
+    int barrier_commit;  // fdatasync between a record's body and its commit word so the commit can't land first
+} posix_hal_config;
+
+// has to be called before flashlog_init, otherwise the defaults above are used
+void posix_hal_configure(const posix_hal_config *config);
+
+#endif
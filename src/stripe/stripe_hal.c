@@ -0,0 +1,392 @@
+#include "stripe_hal.h"
+#include "../include/globals.h"
+#include "../include/utils/utils.h"
+#include "../include/debug/debug.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef FLASHLOG_CONCURRENT
+#include <pthread.h>
+#endif
+
+#define STRIPE_SECTORS (PARTITION_SIZE / SECTOR_SIZE)
+
+typedef enum {
+    OP_WRITE,
+    OP_ERASE
+} stripe_op_type;
+
+typedef struct stripe_op {
+    struct stripe_op *next;
+    uint8_t type;
+    uint32_t addr;  // device address, or device sector for OP_ERASE
+    uint32_t len;
+    uint8_t data[];
+} stripe_op;
+
+typedef struct {
+    flash_hal_t hal;
+
+#ifdef FLASHLOG_CONCURRENT
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    stripe_op *head;
+    stripe_op *tail;
+    uint32_t queued_bytes;
+    uint32_t queued_writes; // writes queued or running, sync only waits for these
+    int busy;           // the worker is running an op outside the lock
+    int running;
+    int stop;
+    flash_error error;  // first queued op that failed, handed to the next caller
+#endif
+    
+    // device sector an erase was already queued for by pre_erase
+    uint32_t pre_erased;
+    int has_pre_erased;
+} stripe_device;
+
+static stripe_device devices[STRIPE_MAX_DEVICES];
+static uint32_t device_count = 0;
+static stripe_config config;
+static flash_hal_t previous;
+static int active = 0;
+
+void stripe_map(uint32_t addr, uint32_t *device, uint32_t *device_addr) {
+    uint32_t count = device_count ? device_count : 1;
+    uint32_t sector = addr / SECTOR_SIZE;
+    
+    *device = sector % count;
+    *device_addr = (sector / count) * SECTOR_SIZE + addr % SECTOR_SIZE;
+}
+
+#ifdef FLASHLOG_CONCURRENT
+
+static flash_error run_op(stripe_device *device, const stripe_op *op) {
+    if (op->type == OP_ERASE) {return device->hal.erase(op->addr);}
+    return device->hal.write(op->addr, op->data, op->len);
+}
+
+static void *worker(void *arg) {
+    stripe_device *device = (stripe_device*)arg;
+    
+    pthread_mutex_lock(&device->lock);
+    while (1) {
+        while (device->head == NULL && !device->stop) {pthread_cond_wait(&device->changed, &device->lock);}
+        if (device->head == NULL) {break;}
+        
+        stripe_op *op = device->head;
+        device->head = op->next;
+        if (device->head == NULL) {device->tail = NULL;}
+        device->busy = 1;
+        pthread_mutex_unlock(&device->lock);
+        
+        flash_error error = run_op(device, op);
+        
+        pthread_mutex_lock(&device->lock);
+        device->busy = 0;
+        device->queued_bytes -= op->len;
+        if (op->type == OP_WRITE) {device->queued_writes--;}
+        if (error != ERR_SUCCESS && device->error == ERR_SUCCESS) {
+            debug_print("Stripe device %u failed op %u at %u: %i\n", (uint32_t)(device - devices), op->type, op->addr, error);
+            device->error = error;
+        }
+        pthread_cond_broadcast(&device->changed);
+        free(op);
+    }
+    pthread_mutex_unlock(&device->lock);
+    
+    return NULL;
+}
+
+// has to be called with the lock held
+static void wait_idle_locked(stripe_device *device) {
+    while (device->head != NULL || device->busy) {pthread_cond_wait(&device->changed, &device->lock);}
+}
+
+static flash_error take_error_locked(stripe_device *device) {
+    flash_error error = device->error;
+    device->error = ERR_SUCCESS;
+    return error;
+}
+
+static flash_error enqueue(stripe_device *device, uint8_t type, uint32_t addr, const void *ptr, uint32_t len) {
+    stripe_op *op = (stripe_op*)malloc(sizeof(stripe_op) + len);
+    if (op == NULL) {return ERR_FAIL;}
+    
+    op->next = NULL;
+    op->type = type;
+    op->addr = addr;
+    op->len = len;
+    if (len > 0) {memcpy(op->data, ptr, len);}
+    
+    pthread_mutex_lock(&device->lock);
+    
+    // an op bigger than the whole limit still goes through once the queue is empty
+    while (device->queued_bytes > 0 && device->queued_bytes + len > config.queue_bytes) {
+        pthread_cond_wait(&device->changed, &device->lock);
+    }
+    
+    // a failed earlier op fails this call, and this op isn't queued behind it
+    flash_error error = take_error_locked(device);
+    if (error != ERR_SUCCESS) {
+        pthread_mutex_unlock(&device->lock);
+        free(op);
+        return error;
+    }
+    
+    if (device->tail) {device->tail->next = op;}
+    else {device->head = op;}
+    device->tail = op;
+    device->queued_bytes += len;
+    if (type == OP_WRITE) {device->queued_writes++;}
+    
+    pthread_cond_broadcast(&device->changed);
+    pthread_mutex_unlock(&device->lock);
+    
+    return ERR_SUCCESS;
+}
+
+static flash_error device_write(stripe_device *device, uint32_t addr, const void *ptr, uint32_t len) {
+    return enqueue(device, OP_WRITE, addr, ptr, len);
+}
+
+static flash_error device_erase(stripe_device *device, uint32_t sector) {
+    return enqueue(device, OP_ERASE, sector, NULL, 0);
+}
+
+// holds the lock for the read so nothing queued after this call can land halfway through it
+static flash_error device_read(stripe_device *device, uint32_t addr, void *ptr, uint32_t len) {
+    pthread_mutex_lock(&device->lock);
+    wait_idle_locked(device);
+    
+    flash_error error = take_error_locked(device);
+    if (error == ERR_SUCCESS) {error = device->hal.read(addr, ptr, len);}
+    
+    pthread_mutex_unlock(&device->lock);
+    return error;
+}
+
+static flash_error device_drain(stripe_device *device) {
+    pthread_mutex_lock(&device->lock);
+    wait_idle_locked(device);
+    flash_error error = take_error_locked(device);
+    pthread_mutex_unlock(&device->lock);
+    return error;
+}
+
+// waits for the writes queued so far and whatever is ahead of them, but not for erases queued
+// after the last one, those are pre_erases of sectors the log hasn't reached yet
+static flash_error device_sync_writes(stripe_device *device) {
+    pthread_mutex_lock(&device->lock);
+    while (device->queued_writes > 0) {pthread_cond_wait(&device->changed, &device->lock);}
+    flash_error error = take_error_locked(device);
+    pthread_mutex_unlock(&device->lock);
+    return error;
+}
+
+static int start_worker(stripe_device *device) {
+    pthread_mutex_init(&device->lock, NULL);
+    pthread_cond_init(&device->changed, NULL);
+    device->head = NULL;
+    device->tail = NULL;
+    device->queued_bytes = 0;
+    device->queued_writes = 0;
+    device->busy = 0;
+    device->stop = 0;
+    device->error = ERR_SUCCESS;
+    
+    device->running = pthread_create(&device->thread, NULL, &worker, device) == 0;
+    return device->running ? 0 : -1;
+}
+
+static void stop_worker(stripe_device *device) {
+    if (!device->running) {return;}
+    
+    pthread_mutex_lock(&device->lock);
+    device->stop = 1;
+    pthread_cond_broadcast(&device->changed);
+    pthread_mutex_unlock(&device->lock);
+    
+    pthread_join(device->thread, NULL);
+    device->running = 0;
+    pthread_mutex_destroy(&device->lock);
+    pthread_cond_destroy(&device->changed);
+}
+
+#else
+
+static flash_error device_write(stripe_device *device, uint32_t addr, const void *ptr, uint32_t len) {return device->hal.write(addr, ptr, len);}
+static flash_error device_erase(stripe_device *device, uint32_t sector) {return device->hal.erase(sector);}
+static flash_error device_read(stripe_device *device, uint32_t addr, void *ptr, uint32_t len) {return device->hal.read(addr, ptr, len);}
+static flash_error device_drain(stripe_device *device) {(void)device; return ERR_SUCCESS;}
+static flash_error device_sync_writes(stripe_device *device) {(void)device; return ERR_SUCCESS;}
+static int start_worker(stripe_device *device) {(void)device; return 0;}
+static void stop_worker(stripe_device *device) {(void)device;}
+
+#endif
+
+static int stripe_init() {
+    for (uint32_t i = 0; i < device_count; i++) {
+        devices[i].has_pre_erased = 0;
+        
+        int result = devices[i].hal.init ? devices[i].hal.init() : 0;
+        if (result == 0) {result = start_worker(&devices[i]);}
+        
+        if (result != 0) {
+            debug_print("Stripe device %u failed to init: %i\n", i, result);
+            
+            // undo the ones that already came up
+            for (uint32_t j = 0; j < i; j++) {
+                stop_worker(&devices[j]);
+                if (devices[j].hal.deinit) {devices[j].hal.deinit();}
+            }
+            return result;
+        }
+    }
+    return 0;
+}
+
+static void stripe_deinit() {
+    for (uint32_t i = 0; i < device_count; i++) {
+        device_drain(&devices[i]);
+        stop_worker(&devices[i]);
+        if (devices[i].hal.deinit) {devices[i].hal.deinit();}
+    }
+}
+
+// splits at sector boundaries, every piece lives on one device
+static flash_error stripe_write(uint32_t addr, const void *ptr, uint32_t len) {
+    if (ptr == NULL) {return ERR_NULL_PTR;}
+    if (addr > PARTITION_SIZE || len > PARTITION_SIZE - addr) {return ERR_OUT_OF_BOUNDS;}
+    
+    const uint8_t *bytes = (const uint8_t*)ptr;
+    while (len > 0) {
+        uint32_t count = min(len, SECTOR_SIZE - addr % SECTOR_SIZE);
+        uint32_t device, device_addr;
+        stripe_map(addr, &device, &device_addr);
+        
+        flash_error error = device_write(&devices[device], device_addr, bytes, count);
+        if (error != ERR_SUCCESS) {return error;}
+        
+        addr += count;
+        bytes += count;
+        len -= count;
+    }
+    return ERR_SUCCESS;
+}
+
+static flash_error stripe_read(uint32_t addr, void *ptr, uint32_t len) {
+    if (ptr == NULL) {return ERR_NULL_PTR;}
+    if (addr > PARTITION_SIZE || len > PARTITION_SIZE - addr) {return ERR_OUT_OF_BOUNDS;}
+    
+    uint8_t *bytes = (uint8_t*)ptr;
+    while (len > 0) {
+        uint32_t count = min(len, SECTOR_SIZE - addr % SECTOR_SIZE);
+        uint32_t device, device_addr;
+        stripe_map(addr, &device, &device_addr);
+        
+        flash_error error = device_read(&devices[device], device_addr, bytes, count);
+        if (error != ERR_SUCCESS) {return error;}
+        
+        addr += count;
+        bytes += count;
+        len -= count;
+    }
+    return ERR_SUCCESS;
+}
+
+static flash_error stripe_erase(uint32_t sector) {
+    if (sector >= STRIPE_SECTORS) {return ERR_OUT_OF_BOUNDS;}
+    
+    uint32_t device, device_addr;
+    stripe_map(sector * SECTOR_SIZE, &device, &device_addr);
+    stripe_device *target = &devices[device];
+    uint32_t device_sector = device_addr / SECTOR_SIZE;
+    
+    flash_error error = ERR_SUCCESS;
+    if (target->has_pre_erased && target->pre_erased == device_sector) {
+        // already queued ahead of time, anything written to it queues up behind that erase
+        target->has_pre_erased = 0;
+    } else {
+        error = device_erase(target, device_sector);
+    }
+
+#ifdef FLASHLOG_CONCURRENT
+    // the log just started this sector, get the next one ready on its own chip
+    if (error == ERR_SUCCESS && config.pre_erase && device_count > 1) {
+        uint32_t next_device, next_addr;
+        stripe_map(((sector + 1) % STRIPE_SECTORS) * SECTOR_SIZE, &next_device, &next_addr);
+        stripe_device *next = &devices[next_device];
+        
+        if (next_device != device && !(next->has_pre_erased && next->pre_erased == next_addr / SECTOR_SIZE)) {
+            if (device_erase(next, next_addr / SECTOR_SIZE) == ERR_SUCCESS) {
+                next->pre_erased = next_addr / SECTOR_SIZE;
+                next->has_pre_erased = 1;
+            }
+        }
+    }
+#endif
+    
+    return error;
+}
+
+static flash_error stripe_sync() {
+    flash_error result = ERR_SUCCESS;
+    
+    // wait on every chip first so they work through their queues side by side. a chip with
+    // only a pre_erase left isn't waited for
+    for (uint32_t i = 0; i < device_count; i++) {
+        flash_error error = device_sync_writes(&devices[i]);
+        if (result == ERR_SUCCESS) {result = error;}
+    }
+    
+    for (uint32_t i = 0; i < device_count; i++) {
+        if (devices[i].hal.sync == NULL) {continue;}
+        flash_error error = devices[i].hal.sync();
+        if (result == ERR_SUCCESS) {result = error;}
+    }
+    
+    return result;
+}
+
+flash_error stripe_hal_start(const flash_hal_t *hals, uint32_t count, const stripe_config *new_config) {
+    if (hals == NULL) {return ERR_NULL_PTR;}
+    if (count == 0 || count > STRIPE_MAX_DEVICES) {return ERR_INVALID_ARGUMENT;}
+    if (active) {return ERR_INVALID_ARGUMENT;}
+    
+    for (uint32_t i = 0; i < count; i++) {
+        if (hals[i].read == NULL || hals[i].write == NULL || hals[i].erase == NULL) {return ERR_NULL_PTR;}
+    }
+    
+    memset(devices, 0, sizeof(devices));
+    for (uint32_t i = 0; i < count; i++) {devices[i].hal = hals[i];}
+    device_count = count;
+    
+    memset(&config, 0, sizeof(config));
+    if (new_config) {config = *new_config;}
+    if (config.queue_bytes == 0) {config.queue_bytes = 2 * SECTOR_SIZE;}
+    
+    previous = g_flash_hal;
+    g_flash_hal = (flash_hal_t){
+        .init = &stripe_init,
+        .deinit = &stripe_deinit,
+        .write = &stripe_write,
+        .read = &stripe_read,
+        .erase = &stripe_erase,
+        .sync = &stripe_sync,
+        .write_batch = NULL
+    };
+    active = 1;
+    
+    return ERR_SUCCESS;
+}
+
+void stripe_hal_stop() {
+    if (!active) {return;}
+    g_flash_hal = previous;
+    device_count = 0;
+    active = 0;
+}
@@ -0,0 +1,47 @@
+#ifndef STRIPE_HAL_H
+#define STRIPE_HAL_H
+
+#include "../hal/flash_hal.h"
+#include "stdint.h"
+
+// spreads the log over several flash chips. logical sector s lives on device s % count at
+// device sector s / count, so the log itself doesn't know, and mount merges the records of all
+// chips into one sequence order like it would on a single chip. every device has to hold at
+// least FLASHLOG_SECTORS / count (rounded up) sectors.
+//
+// with FLASHLOG_CONCURRENT every device gets a worker thread and programs and erases are
+// queued to it, so while one chip is still programming the sector the log just left, the next
+// sector already goes to another chip. a queued write copies its data, failures show up on
+// the next call for that device or on sync. reads wait until their device has caught up.
+// without it everything goes straight to the devices on the calling thread
+//
+// sync waits until every write queued so far is programmed. a DURABILITY_COMMITTED write syncs,
+// so it waits for its own program and one writer gets no more throughput out of more chips,
+// only the erases pre_erase takes off its path. the speedup needs DURABILITY_FLUSHED or
+// BUFFERED writes with an occasional flashlog_flush / COMMITTED write as the durability point
+
+#define STRIPE_MAX_DEVICES 4
+
+typedef struct {
+    // when the log starts a sector, erase the one after it ahead of time on its own chip so
+    // entering it later doesn't wait for an erase. costs that sector's records a lap early.
+    // only does anything with FLASHLOG_CONCURRENT and more than one device. the queue already
+    // overlaps most erases with programming on the other chips, on the PC sim this made no
+    // measurable difference
+    int pre_erase;
+    
+    // bytes of write data a device may have queued before write blocks, 0 picks 2 * SECTOR_SIZE
+    uint32_t queue_bytes;
+} stripe_config;
+
+// replaces g_flash_hal with the stripe over devices (copied), before flashlog_init.
+// config can be NULL for the defaults. committed writes don't get faster, see above
+flash_error stripe_hal_start(const flash_hal_t *devices, uint32_t count, const stripe_config *config);
+
+// puts the previous g_flash_hal back, after flashlog_deinit
+void stripe_hal_stop();
+
+// where a logical address ends up
+void stripe_map(uint32_t addr, uint32_t *device, uint32_t *device_addr);
+
+#endif
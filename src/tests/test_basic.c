@@ -1,5 +1,16 @@
 #include "stdio.h"
+#include "string.h"
 #include "../core/flashlog.h"
+#include "../trace/trace_hal.h"
+#include "../stripe/stripe_hal.h"
+#include "../include/crc/crc.h"
+#include "../include/crc/crc32c.h"
+
+#ifdef FLASHLOG_CONCURRENT
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#endif
 
 typedef struct {
     uint32_t number;
@@ -24,6 +35,705 @@ void this_one_works() {
 
 uint8_t error;
 
+static int failures;
+
+static void check(int ok, const char *what) {
+    printf("%s: %s\n", ok ? "ok" : "FAIL", what);
+    if (!ok) {failures++;}
+}
+
+// runs on whatever HAL the build links (the PC sim, the POSIX file HAL with its batched
+// writes, ...), wiping its partition first
+static void check_build_hal() {
+    int batched = g_flash_hal.write_batch != NULL;
+    
+    // the hardware stub has no init and only fails, nothing to check there
+    if (!g_flash_hal.init || !g_flash_hal.deinit || !g_flash_hal.read || !g_flash_hal.write || !g_flash_hal.erase) {
+        printf("skip: build HAL is incomplete\n");
+        return;
+    }
+    
+    if (g_flash_hal.init() != 0) {
+        check(0, "build HAL init");
+        return;
+    }
+    for (uint32_t sector = 0; sector < FLASHLOG_SECTORS; sector++) {g_flash_hal.erase(sector);}
+    g_flash_hal.deinit();
+    
+    FlashlogState state = {0};
+    flashlog_init(&state);
+    
+    TestStruct test = {0};
+    for (uint32_t i = 1; i <= 3; i++) {
+        test.number = i;
+        test.just_one_more = (uint16_t)(i * 3);
+        flashlog_write(&state, &test, sizeof(test));
+    }
+    flashlog_deinit();
+    
+    FlashlogState remount = {0};
+    flashlog_init(&remount);
+    TestStruct read = {0};
+    check(read_latest(&remount, &read, sizeof(read)) == ERR_SUCCESS && read.number == 3 && read.just_one_more == 9,
+          batched ? "batched records survive a remount on the build HAL" : "records survive a remount on the build HAL");
+    check(is_valid_record(remount.last_record_addr) == RECORD_VALID, "latest record on the build HAL is committed");
+    flashlog_deinit();
+}
+
+// the behaviour checks below run on a RAM flash instead of the build's HAL, so every run
+// starts from a blank partition and damage can be poked straight into the bytes
+
+static uint8_t ram_flash[PARTITION_SIZE];
+
+static int ram_init() {return 0;}
+static void ram_deinit() {}
+
+static uint32_t ram_written;
+
+static flash_error ram_write(uint32_t addr, const void *ptr, uint32_t len) {
+    ram_written += len;
+    uint32_t padded = (len + FLASH_ALIGN - 1) / FLASH_ALIGN * FLASH_ALIGN;
+    if (addr > PARTITION_SIZE || padded > PARTITION_SIZE - addr) {return ERR_OUT_OF_BOUNDS;}
+    
+    memcpy(ram_flash + addr, ptr, len);
+    memset(ram_flash + addr + len, 0xFF, padded - len);
+    return ERR_SUCCESS;
+}
+
+static uint32_t ram_reads;
+
+static flash_error ram_read(uint32_t addr, void *ptr, uint32_t len) {
+    ram_reads++;
+    if (addr > PARTITION_SIZE || len > PARTITION_SIZE - addr) {return ERR_OUT_OF_BOUNDS;}
+    memcpy(ptr, ram_flash + addr, len);
+    return ERR_SUCCESS;
+}
+
+static flash_error ram_erase(uint32_t sector) {
+    if (sector >= FLASHLOG_SECTORS) {return ERR_OUT_OF_BOUNDS;}
+    memset(ram_flash + sector * SECTOR_SIZE, 0xFF, SECTOR_SIZE);
+    return ERR_SUCCESS;
+}
+
+static void use_ram_flash() {
+    memset(ram_flash, 0xFF, sizeof(ram_flash));
+    g_flash_hal = (flash_hal_t){
+        .init = &ram_init,
+        .deinit = &ram_deinit,
+        .write = &ram_write,
+        .read = &ram_read,
+        .erase = &ram_erase
+    };
+}
+
+// remount with a RAM mirror, the latest record has to come back without touching flash
+static void check_mirror() {
+    use_ram_flash();
+    FlashlogState state = {0};
+    flashlog_init(&state);
+    
+    TestStruct test = {0};
+    test.number = 4;
+    test.another_number = 5;
+    test.just_one_more = 6;
+    flashlog_write(&state, &test, sizeof(test));
+    flashlog_deinit();
+    
+    FlashlogState mirrored = {0};
+    TestStruct mirror_buffer = {0};
+    flashlog_attach_mirror(&mirrored, &mirror_buffer, sizeof(mirror_buffer));
+    check(flashlog_init(&mirrored) == 0 && mirrored.mirror_valid, "mirror filled at mount");
+    
+    ram_reads = 0;
+    TestStruct read = {0};
+    uint32_t size = get_latest_size(&mirrored);
+    flash_error error = read_latest(&mirrored, &read, sizeof(read));
+    
+    check(size == sizeof(TestStruct), "mirrored size");
+    check(error == ERR_SUCCESS && memcmp(&read, &test, sizeof(read)) == 0, "mirrored contents");
+    check(ram_reads == 0, "mirrored reads don't touch flash");
+    flashlog_deinit();
+}
+
+// whatever crc32c_byte_seq runs on here has to agree with the table, at every length and alignment
+static void check_crc32c() {
+    uint8_t bytes[300];
+    for (uint32_t i = 0; i < sizeof(bytes); i++) {bytes[i] = (uint8_t)(i * 131 + 17);}
+    
+    int same = crc32c_byte((const uint8_t*)"123456789", 9) == 0xE3069283;
+    for (uint32_t offset = 0; offset < 4; offset++) {
+        for (uint32_t len = 0; len + offset <= sizeof(bytes); len += 7) {
+            same &= crc32c_byte_seq(start_crc, bytes + offset, len) == crc32c_table_byte_seq(start_crc, bytes + offset, len);
+        }
+    }
+    check(same, crc32c_hardware() ? "crc32c instruction matches the table" : "crc32c table (no instruction on this machine)");
+}
+
+static void check_integrity() {
+    for (uint32_t kind = 0; kind < INTEGRITY_COUNT; kind++) {
+        use_ram_flash();
+        FlashlogState state = {0};
+        flashlog_set_integrity(&state, (integrity_kind)kind);
+        flashlog_init(&state);
+        
+        TestStruct test = {0};
+        for (uint32_t i = 1; i <= 3; i++) {
+            test.number = i;
+            flashlog_write(&state, &test, sizeof(test));
+        }
+        
+        // flip a payload bit of the latest record
+        uint32_t latest = state.last_record_addr;
+        ram_flash[latest + header_size] ^= 0x01;
+        record_state damaged = is_valid_record(latest);
+        
+        if (kind == INTEGRITY_HEADER_ONLY) {
+            check(damaged == RECORD_VALID, "header only records don't check the payload");
+        } else {
+            check(damaged == RECORD_CRC_INVALID, "payload check catches a flipped bit");
+            
+            // mount stops in front of the damaged record
+            FlashlogState remount = {0};
+            flashlog_init(&remount);
+            TestStruct read = {0};
+            check(read_latest(&remount, &read, sizeof(read)) == ERR_SUCCESS && read.number == 2, "mount falls back past a corrupt record");
+        }
+        flashlog_deinit();
+    }
+    
+    // a partition in the original header format is left alone
+    use_ram_flash();
+    memcpy(ram_flash, &LEGACY_HEADER_MAGIC, sizeof(LEGACY_HEADER_MAGIC));
+    FlashlogState legacy = {0};
+    check(flashlog_init(&legacy) == ERR_UNSUPPORTED, "old format partition refused");
+    check(memcmp(ram_flash, &LEGACY_HEADER_MAGIC, sizeof(LEGACY_HEADER_MAGIC)) == 0, "old format partition untouched");
+}
+
+// 40 raw records of this fit one sector, the codec has to need less
+typedef struct {
+    uint32_t counter;
+    uint8_t table[60];
+} CodecStruct;
+
+static uint32_t write_codec_records(FlashlogState *state, CodecStruct *value) {
+    memset(value, 0, sizeof(*value));
+    for (uint32_t i = 0; i < 40; i++) {
+        value->counter = i;
+        value->table[i % sizeof(value->table)] = (uint8_t)(i * 7);
+        flashlog_write(state, value, sizeof(*value));
+    }
+    return state->last_record_addr;
+}
+
+static void check_codec() {
+    static uint8_t mirror[sizeof(CodecStruct)];
+    static uint8_t work[SECTOR_SIZE];
+    CodecStruct last;
+    
+    use_ram_flash();
+    FlashlogState raw = {0};
+    flashlog_init(&raw);
+    uint32_t raw_end = write_codec_records(&raw, &last);
+    flashlog_deinit();
+    
+    use_ram_flash();
+    FlashlogState coded = {0};
+    flashlog_attach_mirror(&coded, mirror, sizeof(mirror));
+    flashlog_enable_codec(&coded, work, sizeof(work), 8);
+    flashlog_init(&coded);
+    uint32_t coded_end = write_codec_records(&coded, &last);
+    flashlog_deinit();
+    check(coded_end < raw_end, "codec records take less flash");
+    
+    // mount has to decode the delta chain back from the last keyframe
+    FlashlogState remount = {0};
+    memset(mirror, 0, sizeof(mirror));
+    flashlog_attach_mirror(&remount, mirror, sizeof(mirror));
+    flashlog_enable_codec(&remount, work, sizeof(work), 8);
+    flashlog_init(&remount);
+    
+    CodecStruct read = {0};
+    check(read_latest(&remount, &read, sizeof(read)) == ERR_SUCCESS && memcmp(&read, &last, sizeof(read)) == 0, "codec round trip through remount");
+    flashlog_deinit();
+}
+
+static uint32_t ram_syncs;
+
+static flash_error ram_sync() {
+    ram_syncs++;
+    return ERR_SUCCESS;
+}
+
+static void check_write_buffer() {
+    static uint8_t page[FLASH_PAGE_SIZE];
+    
+    use_ram_flash();
+    g_flash_hal.sync = &ram_sync;
+    ram_syncs = 0;
+    
+    FlashlogState state = {0};
+    flashlog_attach_write_buffer(&state, page, sizeof(page));
+    flashlog_init(&state);
+    
+    TestStruct test = {0};
+    test.number = 7;
+    flashlog_write_durable(&state, &test, sizeof(test), DURABILITY_BUFFERED);
+    
+    TestStruct read = {0};
+    check(ram_flash[state.last_record_addr] == 0xFF, "buffered record not programmed yet");
+    check(read_latest(&state, &read, sizeof(read)) == ERR_SUCCESS && read.number == 7, "buffered record readable");
+    
+    test.number = 8;
+    flashlog_write_durable(&state, &test, sizeof(test), DURABILITY_COMMITTED);
+    check(is_valid_record(state.last_record_addr) == RECORD_VALID && ram_syncs > 0, "committed record programmed and synced");
+    
+    test.number = 9;
+    flashlog_write_durable(&state, &test, sizeof(test), DURABILITY_BUFFERED);
+    flashlog_flush(&state);
+    flashlog_deinit();
+    
+    FlashlogState remount = {0};
+    flashlog_init(&remount);
+    read = (TestStruct){0};
+    check(read_latest(&remount, &read, sizeof(read)) == ERR_SUCCESS && read.number == 9, "flushed record survives remount");
+    flashlog_deinit();
+}
+
+static uint32_t fake_time;
+
+static uint32_t fake_clock() {return fake_time;}
+
+typedef struct {
+    uint32_t count;
+    uint32_t first;
+    uint32_t last;
+    int ordered;
+} time_query_result;
+
+static int collect_time(void *ctx, const flashlog_record_info *info, const void *data, uint32_t length) {
+    time_query_result *result = (time_query_result*)ctx;
+    const TestStruct *test = (const TestStruct*)data;
+    
+    if (data == NULL || length != sizeof(TestStruct) || test->number * 10 != info->timestamp) {result->ordered = 0;}
+    if (result->count == 0) {result->first = info->timestamp;}
+    else if (info->timestamp <= result->last) {result->ordered = 0;}
+    
+    result->last = info->timestamp;
+    result->count++;
+    return 0;
+}
+
+static void check_time_query() {
+    static flashlog_time_index index;
+    
+    use_ram_flash();
+    FlashlogState state = {0};
+    flashlog_enable_timestamps(&state, &fake_clock, &index);
+    flashlog_init(&state);
+    
+    // a few sectors worth, stamped 0, 10, 20, ...
+    TestStruct test = {0};
+    for (uint32_t i = 0; i < 300; i++) {
+        test.number = i;
+        fake_time = i * 10;
+        flashlog_write(&state, &test, sizeof(test));
+    }
+    
+    TestStruct buffer;
+    time_query_result result = {0, 0, 0, 1};
+    flashlog_query_time(&state, 1000, 1500, &collect_time, &result, &buffer, sizeof(buffer));
+    check(result.count == 51 && result.first == 1000 && result.last == 1500 && result.ordered, "time query bounds are inclusive across sectors");
+    
+    result = (time_query_result){0, 0, 0, 1};
+    flashlog_query_time(&state, 5000, 6000, &collect_time, &result, &buffer, sizeof(buffer));
+    check(result.count == 0, "time query past the newest record is empty");
+    flashlog_deinit();
+}
+
+typedef struct {
+    uint32_t generation;
+    uint32_t settings[250];
+} SnapshotStruct;
+
+// 50 updates of a field or two, raw or as snapshots every 8. returns the bytes programmed
+static uint32_t write_snapshot_run(SnapshotStruct *value, int snapshots) {
+    static uint8_t mirror[sizeof(SnapshotStruct)];
+    static uint8_t work[SECTOR_SIZE];
+    
+    use_ram_flash();
+    ram_written = 0;
+    FlashlogState state = {0};
+    flashlog_attach_mirror(&state, mirror, sizeof(mirror));
+    if (snapshots) {flashlog_enable_snapshots(&state, work, sizeof(work), 8);}
+    flashlog_init(&state);
+    
+    memset(value, 0, sizeof(*value));
+    for (uint32_t i = 0; i < 50; i++) {
+        value->generation = i;
+        value->settings[(i * 37) % 250] = i;
+        flashlog_write(&state, value, sizeof(*value));
+    }
+    flashlog_deinit();
+    return ram_written;
+}
+
+static void check_snapshots() {
+    static SnapshotStruct value;
+    static SnapshotStruct read;
+    static uint8_t mirror[sizeof(SnapshotStruct)];
+    static uint8_t work[SECTOR_SIZE];
+    
+    uint32_t raw_bytes = write_snapshot_run(&value, 0);
+    uint32_t snapshot_bytes = write_snapshot_run(&value, 1);
+    check(snapshot_bytes * 4 < raw_bytes, "snapshots program a fraction of the raw bytes");
+    
+    // the run fits the partition, so the records are in write order from address 0. every
+    // sector starts with a snapshot, after that one comes every 8 updates with 7 patches between
+    uint32_t longest = 0;
+    uint32_t patches = 0;
+    uint32_t total_patches = 0;
+    int in_order = 1;
+    for (uint32_t sector = 0; sector < FLASHLOG_SECTORS; sector++) {
+        uint32_t address = sector * SECTOR_SIZE;
+        record_header header;
+        
+        while (address + header_size <= (sector + 1) * SECTOR_SIZE) {
+            memcpy(&header, ram_flash + address, header_size);
+            if (!is_valid_header(&header)) {break;}
+            
+            uint32_t codec = record_codec_of(&header);
+            if (codec == CODEC_PATCH) {
+                if (address == sector * SECTOR_SIZE) {in_order = 0;}
+                patches++;
+                total_patches++;
+            } else {
+                patches = 0;
+            }
+            if (patches > longest) {longest = patches;}
+            address += get_total_record_size(header.content_length);
+        }
+    }
+    check(total_patches > 0 && in_order && longest == 7, "patches between snapshots, a snapshot every 8 updates");
+    
+    FlashlogState remount = {0};
+    memset(mirror, 0, sizeof(mirror));
+    flashlog_attach_mirror(&remount, mirror, sizeof(mirror));
+    flashlog_enable_snapshots(&remount, work, sizeof(work), 8);
+    flashlog_init(&remount);
+    
+    memset(&read, 0, sizeof(read));
+    check(read_latest(&remount, &read, sizeof(read)) == ERR_SUCCESS && memcmp(&read, &value, sizeof(read)) == 0, "snapshot and patches restore at mount");
+    flashlog_deinit();
+}
+
+#ifdef FLASHLOG_CONCURRENT
+typedef struct {
+    FlashlogState *state;
+    int done;
+    uint32_t reads;
+    uint32_t torn;
+} reader_work;
+
+static void *latest_reader(void *arg) {
+    reader_work *work = (reader_work*)arg;
+    
+    while (!__atomic_load_n(&work->done, __ATOMIC_ACQUIRE)) {
+        TestStruct read = {0};
+        if (read_latest(work->state, &read, sizeof(read)) != ERR_SUCCESS) {continue;}
+        if (read.number != read.another_number) {work->torn++;}
+        work->reads++;
+    }
+    return NULL;
+}
+
+// the writer wraps the partition while another thread keeps reading the latest record
+static void check_concurrent_reads() {
+    use_ram_flash();
+    FlashlogState state = {0};
+    flashlog_init(&state);
+    
+    reader_work work = {&state, 0, 0, 0};
+    pthread_t reader;
+    pthread_create(&reader, NULL, &latest_reader, &work);
+    
+    TestStruct test = {0};
+    for (uint32_t i = 0; i < 5000; i++) {
+        test.number = i;
+        test.another_number = i;
+        flashlog_write(&state, &test, sizeof(test));
+    }
+    
+    __atomic_store_n(&work.done, 1, __ATOMIC_RELEASE);
+    pthread_join(reader, NULL);
+    check(work.reads > 0 && work.torn == 0, "concurrent reader never sees a torn record");
+    flashlog_deinit();
+}
+#endif
+
+typedef struct {
+    uint32_t events[TRACE_OP_COUNT];
+    uint32_t bytes;
+} trace_counts;
+
+// the events come in as one sink call each, the file header first
+static void count_events(void *ctx, const void *bytes, uint32_t len) {
+    trace_counts *counts = (trace_counts*)ctx;
+    if (counts->bytes > 0 && len == sizeof(trace_event)) {counts->events[((const trace_event*)bytes)->op]++;}
+    counts->bytes += len;
+}
+
+static void check_trace() {
+    use_ram_flash();
+    
+    trace_counts counts;
+    memset(&counts, 0, sizeof(counts));
+    trace_config config = {0};
+    config.sink = &count_events;
+    config.ctx = &counts;
+    trace_hal_start(&config);
+    
+    FlashlogState state = {0};
+    flashlog_init(&state);
+    
+    TestStruct test = {0};
+    for (uint32_t i = 0; i < 3; i++) {trace_flashlog_write(&state, &test, sizeof(test), DURABILITY_COMMITTED);}
+    trace_read_latest(&state, &test, sizeof(test));
+    flashlog_deinit();
+    
+    const trace_stats *stats = trace_hal_stats();
+    check(stats->calls[TRACE_LOG_WRITE] == 3 && stats->calls[TRACE_LOG_READ] == 1 && stats->calls[TRACE_INIT] == 1, "trace counts the log calls");
+    check(stats->calls[TRACE_WRITE] >= 3 && counts.events[TRACE_WRITE] == stats->calls[TRACE_WRITE] && counts.events[TRACE_READ] == stats->calls[TRACE_READ],
+          "trace sink sees every HAL call");
+    
+    trace_hal_stop();
+    check(g_flash_hal.write == &ram_write, "trace stop puts the HAL back");
+    
+    // nothing may reach the sink after stop, its ctx could already be closed
+    trace_counts before = counts;
+    flashlog_init(&state);
+    trace_flashlog_write(&state, &test, sizeof(test), DURABILITY_COMMITTED);
+    flashlog_deinit();
+    check(memcmp(&before, &counts, sizeof(counts)) == 0 && stats->calls[TRACE_LOG_WRITE] == 3, "trace sink is quiet after stop");
+    
+    trace_hal_start(&config);
+    check(stats->calls[TRACE_LOG_WRITE] == 0 && stats->calls[TRACE_WRITE] == 0, "trace start clears the stats");
+    trace_hal_stop();
+}
+
+// files for the flash_inspect tests in CMakeLists.txt: an image with one torn and one corrupt
+// record among 8 valid ones, and a record stream too big for one partition
+static void write_inspect_fixtures() {
+    use_ram_flash();
+    FlashlogState state = {0};
+    flashlog_init(&state);
+    
+    uint32_t addresses[10];
+    TestStruct test = {0};
+    for (uint32_t i = 0; i < 10; i++) {
+        test.number = i;
+        flashlog_write(&state, &test, sizeof(test));
+        addresses[i] = state.last_record_addr;
+    }
+    flashlog_deinit();
+    
+    // torn: the payload only half made it and the commit word never did
+    uint32_t commit = addresses[3] + get_total_record_size(sizeof(TestStruct)) - sizeof(uint32_t);
+    ram_flash[addresses[3] + header_size] ^= 0x5A;
+    memset(ram_flash + commit, 0xFF, sizeof(uint32_t));
+    
+    // corrupt: committed, then a bit rotted
+    ram_flash[addresses[5] + header_size + 1] ^= 0x01;
+    
+    FILE *image = fopen("inspect_fixture.bin", "wb");
+    int written = image != NULL && fwrite(ram_flash, 1, sizeof(ram_flash), image) == sizeof(ram_flash);
+    if (image) {fclose(image);}
+    
+    FILE *stream = fopen("inspect_overflow.bin", "wb");
+    uint8_t payload[1000];
+    memset(payload, 0xA5, sizeof(payload));
+    for (uint32_t i = 0; stream != NULL && i < 100; i++) {
+        uint32_t length = sizeof(payload);
+        payload[0] = (uint8_t)i;
+        written &= fwrite(&length, sizeof(length), 1, stream) == 1 && fwrite(payload, 1, length, stream) == length;
+    }
+    if (stream) {fclose(stream);}
+    
+    check(written && stream != NULL, "inspector fixtures written");
+}
+
+// two RAM chips for the stripe, either can also hold the whole partition on its own
+static uint8_t ram_chips[2][PARTITION_SIZE];
+
+// program and erase time of the RAM chips in microseconds, 0 for none
+static uint32_t chip_page_us;
+static uint32_t chip_erase_us;
+
+#ifdef FLASHLOG_CONCURRENT
+static void chip_delay(uint32_t us) {if (us) {usleep(us);}}
+#else
+static void chip_delay(uint32_t us) {(void)us;}
+#endif
+
+#define RAM_CHIP(n) \
+    static flash_error chip_write_##n(uint32_t addr, const void *ptr, uint32_t len) { \
+        if (addr > sizeof(ram_chips[n]) || len > sizeof(ram_chips[n]) - addr) {return ERR_OUT_OF_BOUNDS;} \
+        chip_delay(chip_page_us * ((len + FLASH_PAGE_SIZE - 1) / FLASH_PAGE_SIZE)); \
+        memcpy(ram_chips[n] + addr, ptr, len); \
+        return ERR_SUCCESS; \
+    } \
+    static flash_error chip_read_##n(uint32_t addr, void *ptr, uint32_t len) { \
+        if (addr > sizeof(ram_chips[n]) || len > sizeof(ram_chips[n]) - addr) {return ERR_OUT_OF_BOUNDS;} \
+        memcpy(ptr, ram_chips[n] + addr, len); \
+        return ERR_SUCCESS; \
+    } \
+    static flash_error chip_erase_##n(uint32_t sector) { \
+        if ((sector + 1) * SECTOR_SIZE > sizeof(ram_chips[n])) {return ERR_OUT_OF_BOUNDS;} \
+        chip_delay(chip_erase_us); \
+        memset(ram_chips[n] + sector * SECTOR_SIZE, 0xFF, SECTOR_SIZE); \
+        return ERR_SUCCESS; \
+    }
+
+RAM_CHIP(0)
+RAM_CHIP(1)
+
+static void check_stripe() {
+    memset(ram_chips, 0xFF, sizeof(ram_chips));
+    flash_hal_t chips[2] = {
+        {.init = &ram_init, .deinit = &ram_deinit, .write = &chip_write_0, .read = &chip_read_0, .erase = &chip_erase_0},
+        {.init = &ram_init, .deinit = &ram_deinit, .write = &chip_write_1, .read = &chip_read_1, .erase = &chip_erase_1}
+    };
+    
+    stripe_hal_start(chips, 2, NULL);
+    FlashlogState state = {0};
+    flashlog_init(&state);
+    
+    // wraps the striped partition, so both chips hold records of several laps
+    TestStruct test = {0};
+    for (uint32_t i = 0; i < 3000; i++) {
+        test.number = i;
+        flashlog_write(&state, &test, sizeof(test));
+    }
+    flashlog_deinit();
+    stripe_hal_stop();
+    
+    stripe_hal_start(chips, 2, NULL);
+    FlashlogState remount = {0};
+    flashlog_init(&remount);
+    
+    TestStruct read = {0};
+    check(read_latest(&remount, &read, sizeof(read)) == ERR_SUCCESS && read.number == 2999 && remount.last_record_seq == 3000, "stripe remount finds the latest record");
+    
+    // every sector of both chips starts with a record
+    uint32_t on_chip[2] = {0, 0};
+    for (uint32_t chip = 0; chip < 2; chip++) {
+        for (uint32_t offset = 0; offset < sizeof(ram_chips[chip]); offset += SECTOR_SIZE) {
+            on_chip[chip] += memcmp(ram_chips[chip] + offset, &HEADER_MAGIC, sizeof(HEADER_MAGIC)) == 0;
+        }
+    }
+    check(on_chip[0] == FLASHLOG_SECTORS / 2 && on_chip[1] == FLASHLOG_SECTORS / 2, "stripe spreads the sectors over both chips");
+    
+    flashlog_deinit();
+    stripe_hal_stop();
+    use_ram_flash();
+}
+
+#ifdef FLASHLOG_CONCURRENT
+static double seconds() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+// time for a lap and a half of records over count chips
+static double timed_stripe_run(uint32_t count, flashlog_durability durability, int pre_erase) {
+    memset(ram_chips, 0xFF, sizeof(ram_chips));
+    flash_hal_t chips[2] = {
+        {.init = &ram_init, .deinit = &ram_deinit, .write = &chip_write_0, .read = &chip_read_0, .erase = &chip_erase_0},
+        {.init = &ram_init, .deinit = &ram_deinit, .write = &chip_write_1, .read = &chip_read_1, .erase = &chip_erase_1}
+    };
+    stripe_config config = {.pre_erase = pre_erase, .queue_bytes = 0};
+    
+    stripe_hal_start(chips, count, &config);
+    FlashlogState state = {0};
+    flashlog_init(&state);
+    
+    uint32_t payload[60] = {0};
+    double start = seconds();
+    for (uint32_t i = 0; i < 6 * PARTITION_SIZE / sizeof(payload) / 4; i++) {
+        payload[0] = i;
+        flashlog_write_durable(&state, payload, sizeof(payload), durability);
+    }
+    flashlog_flush(&state);
+    g_flash_hal.sync();
+    double elapsed = seconds() - start;
+    
+    flashlog_deinit();
+    stripe_hal_stop();
+    return elapsed;
+}
+
+// with chip latency a second chip has to make flushed writes faster. committed writes wait for
+// their own program either way, pre_erase only takes the erases off their path
+static void check_stripe_scaling() {
+    chip_page_us = 200;
+    chip_erase_us = 10000;
+    
+    double flushed_one = timed_stripe_run(1, DURABILITY_FLUSHED, 0);
+    double flushed_two = timed_stripe_run(2, DURABILITY_FLUSHED, 0);
+    double committed_one = timed_stripe_run(1, DURABILITY_COMMITTED, 0);
+    double committed_two = timed_stripe_run(2, DURABILITY_COMMITTED, 1);
+    printf("stripe: flushed %.3fs on one chip, %.3fs on two, committed %.3fs / %.3fs\n", flushed_one, flushed_two, committed_one, committed_two);
+    
+    check(flushed_two < flushed_one * 0.75, "two chips make flushed writes faster");
+    check(committed_two < committed_one * 0.8, "pre_erase keeps erases off committed writes");
+    
+    chip_page_us = 0;
+    chip_erase_us = 0;
+    use_ram_flash();
+}
+#endif
+
+static void check_scrub() {
+    static flashlog_bad_map map;
+    
+    use_ram_flash();
+    FlashlogState state = {0};
+    flashlog_init(&state);
+    flashlog_enable_scrub(&state, &map);
+    
+    TestStruct test = {0};
+    for (uint32_t i = 0; i < 500; i++) {
+        test.number = i;
+        flashlog_write(&state, &test, sizeof(test));
+    }
+    
+    flashlog_scrub_result result;
+    uint32_t bad = 0;
+    do {
+        flashlog_scrub(&state, 512, &result);
+        bad += result.bad;
+    } while (!result.wrapped);
+    check(bad == 0, "scrub pass over a clean log");
+    
+    // rot a bit in the first record and in the latest one
+    uint32_t latest = state.last_record_addr;
+    ram_flash[header_size] ^= 0x10;
+    ram_flash[latest + header_size] ^= 0x10;
+    
+    flashlog_scrub_all(&state, 2, &result);
+    check(result.bad == 2 && flashlog_record_is_bad(&state, 0) && flashlog_record_is_bad(&state, latest), "scrub finds the injected corruption");
+    check(read_latest(&state, &test, sizeof(test)) == ERR_CORRUPT, "latest read refuses a record the scrub marked");
+    
+    // wrapping erases both sectors, their bits go with them
+    for (uint32_t i = 0; i < 2000; i++) {
+        test.number = i;
+        flashlog_write(&state, &test, sizeof(test));
+    }
+    flashlog_scrub_all(&state, 2, &result);
+    check(result.bad == 0 && !flashlog_record_is_bad(&state, 0), "erase clears the bad records");
+    flashlog_deinit();
+}
+
 int main() {
     FlashlogState state = {0};
     error = flashlog_init(&state);
@@ -71,4 +781,26 @@ int main() {
     // test the sector skipping
     
     flashlog_deinit();
+    
+    check_build_hal();
+    check_mirror();
+    check_crc32c();
+    check_integrity();
+    check_codec();
+    check_write_buffer();
+    check_time_query();
+    check_snapshots();
+#ifdef FLASHLOG_CONCURRENT
+    check_concurrent_reads();
+#endif
+    check_trace();
+    write_inspect_fixtures();
+    check_stripe();
+#ifdef FLASHLOG_CONCURRENT
+    check_stripe_scaling();
+#endif
+    check_scrub();
+    
+    printf("%i failure(s)\n", failures);
+    return failures != 0;
 }
\ No newline at end of file
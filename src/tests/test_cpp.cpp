@@ -0,0 +1,116 @@
+#include "stdio.h"
+#include "../cpp/FlashLog.hpp"
+
+// compiles the C++ front end against the core and runs it on a RAM policy HAL
+
+struct Sample {
+    uint32_t number;
+    uint16_t triple;
+    uint8_t noise[33];
+};
+
+static uint8_t memory[PARTITION_SIZE];
+
+struct MemoryHal {
+    static int init() {return 0;}
+    static void deinit() {}
+    
+    static flash_error read(uint32_t addr, void *ptr, uint32_t len) {
+        if (addr > PARTITION_SIZE || len > PARTITION_SIZE - addr) {return ERR_OUT_OF_BOUNDS;}
+        memcpy(ptr, memory + addr, len);
+        return ERR_SUCCESS;
+    }
+    
+    static flash_error write(uint32_t addr, const void *ptr, uint32_t len) {
+        if (addr > PARTITION_SIZE || len > PARTITION_SIZE - addr) {return ERR_OUT_OF_BOUNDS;}
+        memcpy(memory + addr, ptr, len);
+        return ERR_SUCCESS;
+    }
+    
+    static flash_error erase(uint32_t sector) {
+        if (sector >= FLASHLOG_SECTORS) {return ERR_OUT_OF_BOUNDS;}
+        memset(memory + sector * SECTOR_SIZE, 0xFF, SECTOR_SIZE);
+        return ERR_SUCCESS;
+    }
+    
+    static flash_error sync() {return ERR_SUCCESS;}
+};
+
+static_assert(flashlog::detail::has_sync<MemoryHal>::value, "sync should be picked up");
+static_assert(!flashlog::detail::has_sync<flashlog::TableHal>::value, "TableHal has no sync");
+
+static int failures;
+
+static void check(int ok, const char *what) {
+    printf("%s: %s\n", ok ? "ok" : "FAIL", what);
+    if (!ok) {failures++;}
+}
+
+int main() {
+    memset(memory, 0xFF, sizeof(memory));
+    
+    const uint32_t count = 3000; // wraps the partition a few times
+    
+    {
+        flashlog::FlashLog<Sample, MemoryHal> log;
+        log.attach_mirror();
+        check(log.init() == 0, "init");
+        
+        // a second log would fight over g_flash_hal
+        flashlog::FlashLog<Sample> other;
+        check(other.init() == ERR_UNSUPPORTED, "second log refused while one is mounted");
+        check(other.deinit() == ERR_UNINITIALIZED, "second log can't deinit the mounted one");
+        
+        Sample sample = {};
+        for (uint32_t i = 0; i < count; i++) {
+            sample.number = i;
+            sample.triple = (uint16_t)(i * 3);
+            sample.noise[i % sizeof(sample.noise)] ^= 1;
+            if (log.append(sample) != ERR_SUCCESS) {break;}
+        }
+        
+        Sample latest = {};
+        check(log.latest(latest) == ERR_SUCCESS && latest.number == count - 1, "latest after wrapping");
+        check(log.deinit() == 0, "deinit");
+    }
+    
+    // remount through the same policy, iteration runs oldest first with no holes
+    flashlog::FlashLog<Sample, MemoryHal> log;
+    check(log.init() == 0, "remount");
+    
+    Sample latest = {};
+    check(log.latest(latest) == ERR_SUCCESS && latest.number == count - 1, "latest after remount");
+    
+    uint32_t seen = 0;
+    uint32_t previous = 0;
+    int ordered = 1;
+    for (const Sample &sample : log) {
+        if (seen > 0 && sample.number != previous + 1) {ordered = 0;}
+        if (sample.triple != (uint16_t)(sample.number * 3)) {ordered = 0;}
+        previous = sample.number;
+        seen++;
+    }
+    check(ordered && seen > log.records_per_sector && previous == count - 1, "iteration oldest first");
+    
+    log.deinit();
+    
+    // the destructor has to program what's still in the write buffer
+    {
+        static uint8_t page[FLASH_PAGE_SIZE];
+        flashlog::FlashLog<Sample, MemoryHal> buffered;
+        flashlog_attach_write_buffer(&buffered.state(), page, sizeof(page));
+        buffered.init();
+        
+        Sample sample = {};
+        sample.number = count;
+        sample.triple = (uint16_t)(count * 3);
+        buffered.append(sample, DURABILITY_BUFFERED);
+    }
+    
+    flashlog::FlashLog<Sample, MemoryHal> reopened;
+    reopened.init();
+    check(reopened.latest(latest) == ERR_SUCCESS && latest.number == count, "destructor flushes the write buffer");
+    
+    printf("%i failure(s)\n", failures);
+    return failures != 0;
+}
@@ -0,0 +1,527 @@
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "time.h"
+#include "../core/flashlog.h"
+#include "../include/utils/utils.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// offline tool for flash images pulled off devices, runs the same record parser as the firmware.
+//
+//   flash_inspect [-f csv|json|raw] [-o out] [-j threads] image.bin
+//
+// decodes every partition of the image (a fleet dump is just partitions back to back) and
+// reports the fill of every sector, torn and corrupt records and gaps in the sequence. with -f
+// the records are written out as well, to out or stdout. raw is a record stream: a u32 length
+// followed by the decoded payload for every valid record, oldest first, the same format build
+// takes. the record checks are split across threads, one partition at a time
+//
+//   flash_inspect build [-i KIND] [-c N | -s N] [-n copies] -o image.bin stream.bin
+//
+// the other direction, runs a record stream through the log into an in memory partition and
+// writes it out copies times (default 1), for provisioning and benchmark fixtures. -c and -s
+// turn on the codec or snapshots with that interval, like flash_replay, so an image written
+// with them can be rebuilt from its raw stream. a stream that doesn't fit the partition is an
+// error, the log would silently drop its oldest records
+
+#define MAX_ENTRIES (PARTITION_SIZE / (sizeof(record_header) + 2 * sizeof(uint32_t)))
+#define BATCH_PARTITIONS 64
+
+typedef enum {
+    ENTRY_VALID,
+    ENTRY_TORN,     // header made it, the commit word didn't
+    ENTRY_CORRUPT   // committed, but the payload doesn't match its check
+} entry_status;
+
+static const char *status_names[] = {"valid", "torn", "corrupt"};
+static const char *codec_names[CODEC_COUNT] = {"raw", "rle", "delta_rle", "patch"};
+
+typedef struct {
+    uint32_t address;
+    record_header header;
+    uint8_t sector;
+    uint8_t status;
+} inspect_entry;
+
+typedef struct {
+    uint32_t fill;          // bytes up to the end of the last thing that isn't erased
+    uint32_t valid;
+    uint32_t torn;
+    uint32_t corrupt;
+    uint32_t bad_regions;   // stretches that don't even have a valid header
+} sector_report;
+
+typedef struct {
+    sector_report sectors[FLASHLOG_SECTORS];
+    inspect_entry entries[MAX_ENTRIES];
+    uint32_t entry_count;
+    uint32_t gaps;
+    uint32_t missing;
+} partition_report;
+
+typedef enum {
+    FORMAT_NONE,
+    FORMAT_CSV,
+    FORMAT_JSON,
+    FORMAT_RAW
+} output_format;
+
+// the log reads through g_flash_hal, pointed at whatever partition the calling thread works on
+static _Thread_local const uint8_t *partition_image;
+static uint8_t *build_image;
+static uint32_t build_overwrites;
+
+static flash_error image_read(uint32_t addr, void *ptr, uint32_t len) {
+    if (ptr == NULL) {return ERR_NULL_PTR;}
+    if (addr > PARTITION_SIZE || len > PARTITION_SIZE - addr) {return ERR_OUT_OF_BOUNDS;}
+    
+    memcpy(ptr, partition_image + addr, len);
+    return ERR_SUCCESS;
+}
+
+static int image_init() {return 0;}
+static void image_deinit() {}
+
+static flash_error image_write(uint32_t addr, const void *ptr, uint32_t len) {
+    if (ptr == NULL) {return ERR_NULL_PTR;}
+    if (addr > PARTITION_SIZE || len > PARTITION_SIZE - addr) {return ERR_OUT_OF_BOUNDS;}
+    
+    memcpy(build_image + addr, ptr, len);
+    return ERR_SUCCESS;
+}
+
+static flash_error image_erase(uint32_t sector) {
+    if (sector >= FLASHLOG_SECTORS) {return ERR_OUT_OF_BOUNDS;}
+    
+    // erasing anything that isn't blank means the ring wrapped onto records of this build
+    uint8_t *start = build_image + sector * SECTOR_SIZE;
+    if (start[0] != 0xFF || memcmp(start, start + 1, SECTOR_SIZE - 1) != 0) {build_overwrites++;}
+    
+    memset(build_image + sector * SECTOR_SIZE, 0xFF, SECTOR_SIZE);
+    return ERR_SUCCESS;
+}
+
+static flash_error image_write_batch(const flash_write_segment *segments, uint32_t count) {
+    for (uint32_t i = 0; i < count; i++) {
+        flash_error error = image_write(segments[i].addr, segments[i].ptr, segments[i].len);
+        if (error != ERR_SUCCESS) {return error;}
+    }
+    return ERR_SUCCESS;
+}
+
+static void use_image_hal() {
+    g_flash_hal.init = &image_init;
+    g_flash_hal.deinit = &image_deinit;
+    g_flash_hal.read = &image_read;
+    g_flash_hal.write = &image_write;
+    g_flash_hal.erase = &image_erase;
+    g_flash_hal.sync = NULL;
+    g_flash_hal.write_batch = &image_write_batch;
+}
+
+// both erased states, the PC sim erases to 0
+static int is_erased(const uint8_t *bytes, uint32_t len) {
+    for (uint32_t i = 1; i < len; i++) {
+        if (bytes[i] != bytes[0]) {return 0;}
+    }
+    return bytes[0] == 0xFF || bytes[0] == 0x00;
+}
+
+static void inspect_sector(uint32_t sector, partition_report *report) {
+    sector_report *out = &report->sectors[sector];
+    uint32_t start = sector * SECTOR_SIZE;
+    uint32_t end = start + SECTOR_SIZE;
+    uint32_t address = start;
+    int in_bad_region = 0;
+    
+    while (address + header_size <= end) {
+        record_header header;
+        image_read(address, &header, header_size);
+        
+        uint32_t total = get_total_record_size(header.content_length);
+        
+        if (!is_valid_header(&header) || total > end - address) {
+            if (is_erased((const uint8_t*)&header, header_size)) {break;}
+            
+            // garbage, step forward until something parses again
+            if (!in_bad_region) {out->bad_regions++;}
+            in_bad_region = 1;
+            address += FLASH_ALIGN;
+            out->fill = address - start;
+            continue;
+        }
+        in_bad_region = 0;
+        
+        // an interrupted write leaves the payload half written as well, so the commit word
+        // decides first. only a committed record that fails its check is corrupt
+        uint32_t commit = 0;
+        image_read(round_up(address + header_size + header.content_length, FLASH_ALIGN), &commit, sizeof(commit));
+        record_state state = commit == COMMIT_MAGIC ? is_valid_record(address) : RECORD_INVALID_COMMIT;
+        
+        inspect_entry *entry = &report->entries[report->entry_count++];
+        entry->address = address;
+        entry->header = header;
+        entry->sector = (uint8_t)sector;
+        
+        if (state == RECORD_VALID) {
+            entry->status = ENTRY_VALID;
+            out->valid++;
+        } else if (state == RECORD_INVALID_COMMIT) {
+            entry->status = ENTRY_TORN;
+            out->torn++;
+        } else {
+            entry->status = ENTRY_CORRUPT;
+            out->corrupt++;
+        }
+        
+        address += total;
+        out->fill = address - start;
+    }
+}
+
+static int compare_entries(const void *a, const void *b) {
+    uint32_t x = ((const inspect_entry*)a)->header.sequence;
+    uint32_t y = ((const inspect_entry*)b)->header.sequence;
+    return (x > y) - (x < y);
+}
+
+static void inspect_partition(const uint8_t *image, partition_report *report) {
+    memset(report, 0, sizeof(*report));
+    partition_image = image;
+    
+    for (uint32_t sector = 0; sector < FLASHLOG_SECTORS; sector++) {
+        inspect_sector(sector, report);
+    }
+    
+    // oldest first, gaps only count between records that are actually there
+    qsort(report->entries, report->entry_count, sizeof(inspect_entry), &compare_entries);
+    
+    uint32_t previous = 0;
+    int have_previous = 0;
+    for (uint32_t i = 0; i < report->entry_count; i++) {
+        if (report->entries[i].status != ENTRY_VALID) {continue;}
+        
+        uint32_t sequence = report->entries[i].header.sequence;
+        if (have_previous && sequence - previous > 1) {
+            report->gaps++;
+            report->missing += sequence - previous - 1;
+        }
+        previous = sequence;
+        have_previous = 1;
+    }
+}
+
+typedef struct {
+    const uint8_t *image;
+    partition_report *reports;
+    uint32_t first;
+    uint32_t count;
+    uint32_t next;
+} batch_work;
+
+static void *worker(void *arg) {
+    batch_work *work = (batch_work*)arg;
+    
+    while (1) {
+        uint32_t index = __atomic_fetch_add(&work->next, 1, __ATOMIC_RELAXED);
+        if (index >= work->count) {break;}
+        
+        inspect_partition(work->image + (size_t)(work->first + index) * PARTITION_SIZE, &work->reports[index]);
+    }
+    
+    return NULL;
+}
+
+static void write_u32(FILE *out, uint32_t value) {
+    fwrite(&value, sizeof(value), 1, out);
+}
+
+// decodes the valid records of a partition oldest first, deltas on top of the record before them
+static void emit_raw(FILE *out, const uint8_t *image, const partition_report *report) {
+    static uint8_t payload[SECTOR_SIZE];
+    FlashlogState state = {0};
+    uint32_t length = 0;
+    uint32_t keyframe_seq = 0;
+    int have_base = 0;
+    
+    partition_image = image;
+    
+    for (uint32_t i = 0; i < report->entry_count; i++) {
+        const inspect_entry *entry = &report->entries[i];
+        if (entry->status != ENTRY_VALID) {
+            have_base = 0;
+            continue;
+        }
+        
+        uint32_t codec = record_codec_of(&entry->header);
+        have_base = decode_record(&state, entry->address, &entry->header, payload, sizeof(payload), &length, have_base, keyframe_seq);
+        if (!have_base) {continue;}
+        if (!is_delta_codec(codec)) {keyframe_seq = entry->header.sequence;}
+        
+        write_u32(out, length);
+        fwrite(payload, 1, length, out);
+    }
+}
+
+static void emit_records(FILE *out, output_format format, uint32_t partition, const uint8_t *image, const partition_report *report, int *first_record) {
+    if (format == FORMAT_RAW) {
+        emit_raw(out, image, report);
+        return;
+    }
+    
+    for (uint32_t i = 0; i < report->entry_count; i++) {
+        const inspect_entry *entry = &report->entries[i];
+        const record_header *header = &entry->header;
+        uint32_t timestamp = (header->flags & FLAG_TIMESTAMP) ? header->timestamp : 0;
+        
+        if (format == FORMAT_CSV) {
+            fprintf(out, "%u,%u,%u,%u,%u,%s,%u,%u,%s\n", partition, entry->sector, entry->address,
+                    header->sequence, header->content_length, codec_names[record_codec_of(header)],
+                    header->flags & FLAG_INTEGRITY_MASK, timestamp, status_names[entry->status]);
+        } else {
+            fprintf(out, "%s\n  {\"partition\": %u, \"sector\": %u, \"address\": %u, \"sequence\": %u, \"length\": %u, "
+                    "\"codec\": \"%s\", \"integrity\": %u, \"timestamp\": %u, \"status\": \"%s\"}",
+                    *first_record ? "" : ",", partition, entry->sector, entry->address,
+                    header->sequence, header->content_length, codec_names[record_codec_of(header)],
+                    header->flags & FLAG_INTEGRITY_MASK, timestamp, status_names[entry->status]);
+            *first_record = 0;
+        }
+    }
+}
+
+static void print_report(FILE *out, uint32_t partition, const partition_report *report) {
+    uint32_t valid = 0, torn = 0, corrupt = 0, bad = 0, used = 0;
+    
+    fprintf(out, "partition %u\n", partition);
+    fprintf(out, "  sector  fill%%   valid  torn  corrupt  bad\n");
+    for (uint32_t sector = 0; sector < FLASHLOG_SECTORS; sector++) {
+        const sector_report *s = &report->sectors[sector];
+        fprintf(out, "  %6u  %5.1f  %6u  %4u  %7u  %3u\n", sector, 100.0 * s->fill / SECTOR_SIZE, s->valid, s->torn, s->corrupt, s->bad_regions);
+        
+        valid += s->valid;
+        torn += s->torn;
+        corrupt += s->corrupt;
+        bad += s->bad_regions;
+        used += s->fill;
+    }
+    
+    fprintf(out, "  %u valid, %u torn, %u corrupt, %u bad regions, %.1f%% used, %u sequence gaps (%u missing)\n",
+            valid, torn, corrupt, bad, 100.0 * used / PARTITION_SIZE, report->gaps, report->missing);
+}
+
+static int inspect(int argc, char **argv) {
+    output_format format = FORMAT_NONE;
+    const char *output = NULL;
+    const char *path = NULL;
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    
+    for (int i = 1; i < argc; i++) {
+        int has_value = i + 1 < argc;
+        
+        if (strcmp(argv[i], "-f") == 0 && has_value) {
+            const char *name = argv[++i];
+            if (strcmp(name, "csv") == 0) {format = FORMAT_CSV;}
+            else if (strcmp(name, "json") == 0) {format = FORMAT_JSON;}
+            else if (strcmp(name, "raw") == 0) {format = FORMAT_RAW;}
+            else {return 2;}
+        }
+        else if (strcmp(argv[i], "-o") == 0 && has_value) {output = argv[++i];}
+        else if (strcmp(argv[i], "-j") == 0 && has_value) {threads = atol(argv[++i]);}
+        else if (argv[i][0] != '-' && path == NULL) {path = argv[i];}
+        else {return 2;}
+    }
+    
+    if (path == NULL) {return 2;}
+    if (threads < 1) {threads = 1;}
+    
+    int fd = open(path, O_RDONLY);
+    struct stat info;
+    if (fd < 0 || fstat(fd, &info) != 0) {
+        printf("can't open %s\n", path);
+        return 1;
+    }
+    
+    uint32_t partitions = (uint32_t)(info.st_size / PARTITION_SIZE);
+    if (partitions == 0) {
+        printf("%s is smaller than a partition\n", path);
+        close(fd);
+        return 1;
+    }
+    if (info.st_size % PARTITION_SIZE != 0) {
+        fprintf(stderr, "warning: ignoring %lld trailing bytes\n", (long long)(info.st_size % PARTITION_SIZE));
+    }
+    
+    const uint8_t *image = mmap(NULL, (size_t)partitions * PARTITION_SIZE, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (image == MAP_FAILED) {
+        printf("can't map %s\n", path);
+        return 1;
+    }
+    
+    FILE *records = NULL;
+    if (format != FORMAT_NONE) {
+        records = output ? fopen(output, format == FORMAT_RAW ? "wb" : "w") : stdout;
+        if (records == NULL) {
+            printf("can't open %s\n", output);
+            return 1;
+        }
+    }
+    // the report goes to stdout unless the records already do
+    FILE *report_out = records == stdout ? NULL : stdout;
+    
+    use_image_hal();
+    
+    if (format == FORMAT_CSV) {fprintf(records, "partition,sector,address,sequence,length,codec,integrity,timestamp,status\n");}
+    if (format == FORMAT_JSON) {fprintf(records, "[");}
+    int first_record = 1;
+    
+    batch_work work = {0};
+    work.image = image;
+    work.reports = malloc(sizeof(partition_report) * BATCH_PARTITIONS);
+    pthread_t *pool = malloc(sizeof(pthread_t) * threads);
+    
+    for (uint32_t first = 0; first < partitions; first += BATCH_PARTITIONS) {
+        work.first = first;
+        work.count = partitions - first < BATCH_PARTITIONS ? partitions - first : BATCH_PARTITIONS;
+        work.next = 0;
+        
+        // the calling thread works along, so threads 1 needs no pool at all
+        long started = 0;
+        for (; started < threads - 1 && started < (long)work.count - 1; started++) {
+            if (pthread_create(&pool[started], NULL, &worker, &work) != 0) {break;}
+        }
+        worker(&work);
+        for (long i = 0; i < started; i++) {pthread_join(pool[i], NULL);}
+        
+        for (uint32_t i = 0; i < work.count; i++) {
+            const uint8_t *partition = image + (size_t)(first + i) * PARTITION_SIZE;
+            if (records) {emit_records(records, format, first + i, partition, &work.reports[i], &first_record);}
+            if (report_out) {print_report(report_out, first + i, &work.reports[i]);}
+        }
+    }
+    
+    if (format == FORMAT_JSON) {fprintf(records, "\n]\n");}
+    if (records && records != stdout) {fclose(records);}
+    
+    free(pool);
+    free(work.reports);
+    munmap((void*)image, (size_t)partitions * PARTITION_SIZE);
+    return 0;
+}
+
+static int build(int argc, char **argv) {
+    const char *output = NULL;
+    const char *path = NULL;
+    int integrity = -1;
+    int codec_interval = 0;
+    int snapshot_interval = 0;
+    long copies = 1;
+    
+    for (int i = 2; i < argc; i++) {
+        int has_value = i + 1 < argc;
+        
+        if (strcmp(argv[i], "-o") == 0 && has_value) {output = argv[++i];}
+        else if (strcmp(argv[i], "-i") == 0 && has_value) {integrity = atoi(argv[++i]);}
+        else if (strcmp(argv[i], "-c") == 0 && has_value) {codec_interval = atoi(argv[++i]);}
+        else if (strcmp(argv[i], "-s") == 0 && has_value) {snapshot_interval = atoi(argv[++i]);}
+        else if (strcmp(argv[i], "-n") == 0 && has_value) {copies = atol(argv[++i]);}
+        else if (argv[i][0] != '-' && path == NULL) {path = argv[i];}
+        else {return 2;}
+    }
+    
+    if (path == NULL || output == NULL || copies < 1) {return 2;}
+    if (codec_interval < 0 || snapshot_interval < 0 || (codec_interval && snapshot_interval)) {return 2;}
+    
+    FILE *stream = fopen(path, "rb");
+    if (stream == NULL) {
+        printf("can't open %s\n", path);
+        return 1;
+    }
+    
+    static uint8_t partition[PARTITION_SIZE];
+    static uint8_t payload[SECTOR_SIZE];
+    static uint8_t mirror[SECTOR_SIZE];
+    static uint8_t work[SECTOR_SIZE];
+    memset(partition, 0xFF, sizeof(partition));
+    build_image = partition;
+    build_overwrites = 0;
+    partition_image = partition;
+    use_image_hal();
+    
+    FlashlogState state = {0};
+    if (integrity >= 0 && flashlog_set_integrity(&state, (integrity_kind)integrity) != ERR_SUCCESS) {
+        printf("unknown integrity kind %i\n", integrity);
+        fclose(stream);
+        return 1;
+    }
+    
+    // the codec deltas against the mirror
+    if (codec_interval || snapshot_interval) {
+        flashlog_attach_mirror(&state, mirror, sizeof(mirror));
+        if (codec_interval) {flashlog_enable_codec(&state, work, sizeof(work), (uint16_t)codec_interval);}
+        else {flashlog_enable_snapshots(&state, work, sizeof(work), (uint16_t)snapshot_interval);}
+    }
+    flashlog_init(&state);
+    
+    struct timespec started;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    
+    uint32_t written = 0;
+    uint64_t bytes = 0;
+    uint32_t length;
+    
+    while (fread(&length, sizeof(length), 1, stream) == 1) {
+        if (length == 0 || length > max_content_length || fread(payload, 1, length, stream) != length) {
+            printf("bad record %u in %s\n", written, path);
+            fclose(stream);
+            return 1;
+        }
+        
+        flash_error error = flashlog_write_durable(&state, payload, length, DURABILITY_BUFFERED);
+        if (error != ERR_SUCCESS) {
+            printf("write %u failed: %i\n", written, error);
+            fclose(stream);
+            return 1;
+        }
+        written++;
+        bytes += length;
+    }
+    fclose(stream);
+    
+    flashlog_flush(&state);
+    if (build_overwrites > 0) {
+        printf("%s doesn't fit the partition, the log wrapped and %u sector(s) of it were overwritten\n", path, build_overwrites);
+        return 1;
+    }
+    
+    struct timespec finished;
+    clock_gettime(CLOCK_MONOTONIC, &finished);
+    double seconds = (finished.tv_sec - started.tv_sec) + (finished.tv_nsec - started.tv_nsec) / 1e9;
+    
+    FILE *out = fopen(output, "wb");
+    if (out == NULL) {
+        printf("can't open %s\n", output);
+        return 1;
+    }
+    for (long i = 0; i < copies; i++) {fwrite(partition, 1, sizeof(partition), out);}
+    fclose(out);
+    
+    printf("%u records, %llu bytes in %.3fs (%.1f MB/s), %ld partition(s) written to %s\n", written,
+           (unsigned long long)bytes, seconds, seconds > 0 ? bytes / seconds / 1e6 : 0.0, copies, output);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    int result = argc > 1 && strcmp(argv[1], "build") == 0 ? build(argc, argv) : inspect(argc, argv);
+    
+    if (result == 2) {
+        printf("usage: flash_inspect [-f csv|json|raw] [-o out] [-j threads] image.bin\n");
+        printf("       flash_inspect build [-i KIND] [-c N | -s N] [-n copies] -o image.bin stream.bin\n");
+    }
+    return result;
+}
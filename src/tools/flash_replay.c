@@ -0,0 +1,234 @@
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "time.h"
+#include "../core/flashlog.h"
+#include "../pc_sim/sim.h"
+#include "../trace/trace_hal.h"
+
+// replays a trace recorded with trace_hal_start against the PC simulated flash.
+//
+//   flash_replay [options] trace.bin
+//
+// physical mode (default) issues the recorded HAL writes, reads, erases and syncs again, which
+// reproduces the exact flash traffic and times it on this machine. logical mode (-l) instead
+// runs the recorded flashlog writes through a freshly configured log, so the same workload can
+// be compared across settings:
+//
+//   -m         attach a mirror
+//   -c N       codec with keyframe interval N (needs -m)
+//   -s N       snapshots with interval N (needs -m)
+//   -p         page write buffer
+//   -i KIND    integrity kind (see integrity_kind)
+//   -o PATH    simulated flash image, default replay.bin. it is wiped first
+
+static const char *op_names[TRACE_OP_COUNT] = {
+    "init", "deinit", "write", "read", "erase", "sync", "write_batch", "log_write", "log_read", "log_flush"
+};
+
+typedef struct {
+    int logical;
+    int mirror;
+    uint16_t codec_interval;
+    uint16_t snapshot_interval;
+    int page_buffer;
+    int integrity;
+    const char *image;
+    const char *trace;
+} replay_options;
+
+static uint32_t micros() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint32_t)(ts.tv_sec * 1000000ull + ts.tv_nsec / 1000);
+}
+
+static uint8_t mirror[SECTOR_SIZE];
+static uint8_t work[SECTOR_SIZE];
+static uint8_t page[FLASH_PAGE_SIZE];
+static uint8_t data[PARTITION_SIZE];
+static uint8_t scratch[PARTITION_SIZE];
+
+static void usage() {
+    printf("usage: flash_replay [-l] [-m] [-c N] [-s N] [-p] [-i KIND] [-o image] trace.bin\n");
+}
+
+static int parse_options(int argc, char **argv, replay_options *options) {
+    options->integrity = -1;
+    options->image = "replay.bin";
+    
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        int has_value = i + 1 < argc;
+        
+        if (strcmp(arg, "-l") == 0) {options->logical = 1;}
+        else if (strcmp(arg, "-m") == 0) {options->mirror = 1;}
+        else if (strcmp(arg, "-p") == 0) {options->page_buffer = 1;}
+        else if (strcmp(arg, "-c") == 0 && has_value) {options->codec_interval = (uint16_t)atoi(argv[++i]);}
+        else if (strcmp(arg, "-s") == 0 && has_value) {options->snapshot_interval = (uint16_t)atoi(argv[++i]);}
+        else if (strcmp(arg, "-i") == 0 && has_value) {options->integrity = atoi(argv[++i]);}
+        else if (strcmp(arg, "-o") == 0 && has_value) {options->image = argv[++i];}
+        else if (arg[0] != '-' && options->trace == NULL) {options->trace = arg;}
+        else {return 1;}
+    }
+    
+    return options->trace == NULL;
+}
+
+static int setup_log(FlashlogState *state, const replay_options *options) {
+    if (options->mirror && flashlog_attach_mirror(state, mirror, sizeof(mirror)) != ERR_SUCCESS) {return 1;}
+    if (options->codec_interval && flashlog_enable_codec(state, work, sizeof(work), options->codec_interval) != ERR_SUCCESS) {return 1;}
+    if (options->snapshot_interval && flashlog_enable_snapshots(state, work, sizeof(work), options->snapshot_interval) != ERR_SUCCESS) {return 1;}
+    if (options->page_buffer && flashlog_attach_write_buffer(state, page, sizeof(page)) != ERR_SUCCESS) {return 1;}
+    if (options->integrity >= 0 && flashlog_set_integrity(state, (integrity_kind)options->integrity) != ERR_SUCCESS) {return 1;}
+    return 0;
+}
+
+// replays one HAL level event, returns the time it took in microseconds
+static uint32_t replay_physical(const trace_event *event, const uint8_t *payload) {
+    uint32_t start = micros();
+    
+    switch (event->op) {
+        case TRACE_WRITE:
+            g_flash_hal.write(event->addr, payload, event->len);
+            break;
+        case TRACE_READ:
+            g_flash_hal.read(event->addr, scratch, event->len);
+            break;
+        case TRACE_ERASE:
+            g_flash_hal.erase(event->addr);
+            break;
+        case TRACE_SYNC:
+            if (g_flash_hal.sync) {g_flash_hal.sync();}
+            break;
+        default:
+            // init/deinit are done once around the replay, batches are replayed through
+            // the TRACE_WRITE events that follow them
+            return 0;
+    }
+    
+    return micros() - start;
+}
+
+static uint32_t replay_logical(FlashlogState *state, const trace_event *event, const uint8_t *payload) {
+    uint32_t start = micros();
+    
+    switch (event->op) {
+        case TRACE_LOG_WRITE:
+            flashlog_write_durable(state, payload, event->len, (flashlog_durability)event->addr);
+            break;
+        case TRACE_LOG_READ:
+            read_latest(state, scratch, event->len);
+            break;
+        case TRACE_LOG_FLUSH:
+            flashlog_flush(state);
+            break;
+        default:
+            return 0;
+    }
+    
+    return micros() - start;
+}
+
+int main(int argc, char **argv) {
+    replay_options options = {0};
+    if (parse_options(argc, argv, &options)) {
+        usage();
+        return 1;
+    }
+    
+    FILE *trace = fopen(options.trace, "rb");
+    if (trace == NULL) {
+        printf("can't open %s\n", options.trace);
+        return 1;
+    }
+    
+    trace_file_header header;
+    if (fread(&header, sizeof(header), 1, trace) != 1 || header.magic != TRACE_MAGIC || header.version != TRACE_VERSION) {
+        printf("%s is not a trace\n", options.trace);
+        fclose(trace);
+        return 1;
+    }
+    
+    if (header.sector_size != SECTOR_SIZE || header.partition_size != PARTITION_SIZE || header.flash_align != FLASH_ALIGN) {
+        printf("warning: trace was recorded with sector %u, partition %u, align %u\n",
+               header.sector_size, header.partition_size, header.flash_align);
+    }
+    
+    remove(options.image);
+    sim_set_file_path(options.image);
+    
+    FlashlogState state = {0};
+    if (options.logical) {
+        if (setup_log(&state, &options)) {
+            printf("invalid log configuration\n");
+            fclose(trace);
+            return 1;
+        }
+    }
+    
+    // replay counts come from the same wrappers that record, with nothing attached as a sink
+    trace_config config = {0};
+    config.clock = &micros;
+    trace_hal_start(&config);
+    
+    int error = options.logical ? flashlog_init(&state) : g_flash_hal.init();
+    if (error != 0) {
+        printf("init failed: %i\n", error);
+        trace_hal_stop();
+        fclose(trace);
+        return 1;
+    }
+    
+    trace_stats recorded = {0};
+    uint64_t replayed[TRACE_OP_COUNT] = {0};
+    uint32_t events = 0;
+    
+    trace_event event;
+    while (fread(&event, sizeof(event), 1, trace) == 1) {
+        if (event.op >= TRACE_OP_COUNT) {
+            printf("bad event %u after %u events\n", event.op, events);
+            break;
+        }
+        
+        const uint8_t *payload = data;
+        uint32_t len = event.len <= sizeof(data) ? event.len : sizeof(data);
+        
+        if (event.flags & TRACE_EVENT_HAS_DATA) {
+            if (event.len > sizeof(data) || fread(data, 1, event.len, trace) != event.len) {
+                printf("truncated data after %u events\n", events);
+                break;
+            }
+        } else if (event.op == TRACE_WRITE || event.op == TRACE_LOG_WRITE) {
+            // recorded without data, synthesize a payload that changes every write
+            memset(data, (uint8_t)events, len);
+        }
+        event.len = len;
+        events++;
+        
+        recorded.calls[event.op]++;
+        recorded.ticks[event.op] += event.duration;
+        
+        replayed[event.op] += options.logical ? replay_logical(&state, &event, payload) : replay_physical(&event, payload);
+    }
+    
+    if (options.logical) {flashlog_flush(&state);}
+    
+    trace_stats result = *trace_hal_stats();
+    trace_hal_stop();
+    
+    if (options.logical) {flashlog_deinit();}
+    else {g_flash_hal.deinit();}
+    fclose(trace);
+    
+    printf("%u events, %s replay into %s\n", events, options.logical ? "logical" : "physical", options.image);
+    printf("%-12s %10s %12s %10s %12s %12s\n", "op", "recorded", "rec ticks", "hal calls", "hal bytes", "replay us");
+    for (int op = 0; op < TRACE_OP_COUNT; op++) {
+        if (recorded.calls[op] == 0 && result.calls[op] == 0) {continue;}
+        printf("%-12s %10u %12llu %10u %12llu %12llu\n", op_names[op], recorded.calls[op],
+               (unsigned long long)recorded.ticks[op], result.calls[op],
+               (unsigned long long)result.bytes[op], (unsigned long long)replayed[op]);
+    }
+    
+    return 0;
+}
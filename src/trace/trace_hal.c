@@ -0,0 +1,166 @@
+#include "trace_hal.h"
+#include "../include/globals.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+static flash_hal_t inner;
+static trace_config active;
+static trace_stats stats;
+static int tracing = 0;
+
+static uint32_t now() {
+    return active.clock ? active.clock() : 0;
+}
+
+static void emit(uint8_t op, uint8_t flags, flash_error result, uint32_t addr, uint32_t len, uint32_t duration, const void *data) {
+    // the trace_flashlog_* wrappers still run after stop, by then ctx may be gone
+    if (!tracing) {return;}
+    
+    stats.calls[op]++;
+    stats.bytes[op] += len;
+    stats.ticks[op] += duration;
+    
+    if (!active.sink) {return;}
+    
+    trace_event event = {0};
+    event.op = op;
+    event.flags = flags;
+    event.result = (uint16_t)result;
+    event.addr = addr;
+    event.len = len;
+    event.duration = duration;
+    
+    int with_data = data != NULL && len > 0 && active.capture_data;
+    if (with_data) {event.flags |= TRACE_EVENT_HAS_DATA;}
+    
+    active.sink(active.ctx, &event, sizeof(event));
+    if (with_data) {active.sink(active.ctx, data, len);}
+}
+
+static int traced_init() {
+    uint32_t start = now();
+    int result = inner.init();
+    emit(TRACE_INIT, 0, result == 0 ? ERR_SUCCESS : ERR_FAIL, 0, 0, now() - start, NULL);
+    return result;
+}
+
+static void traced_deinit() {
+    uint32_t start = now();
+    inner.deinit();
+    emit(TRACE_DEINIT, 0, ERR_SUCCESS, 0, 0, now() - start, NULL);
+}
+
+static flash_error traced_write(uint32_t addr, const void *ptr, uint32_t len) {
+    uint32_t start = now();
+    flash_error result = inner.write(addr, ptr, len);
+    emit(TRACE_WRITE, 0, result, addr, len, now() - start, ptr);
+    return result;
+}
+
+static flash_error traced_read(uint32_t addr, void *ptr, uint32_t len) {
+    uint32_t start = now();
+    flash_error result = inner.read(addr, ptr, len);
+    emit(TRACE_READ, 0, result, addr, len, now() - start, result == ERR_SUCCESS ? ptr : NULL);
+    return result;
+}
+
+static flash_error traced_erase(uint32_t sector) {
+    uint32_t start = now();
+    flash_error result = inner.erase(sector);
+    emit(TRACE_ERASE, 0, result, sector, SECTOR_SIZE, now() - start, NULL);
+    return result;
+}
+
+static flash_error traced_sync() {
+    uint32_t start = now();
+    flash_error result = inner.sync();
+    emit(TRACE_SYNC, 0, result, 0, 0, now() - start, NULL);
+    return result;
+}
+
+static flash_error traced_write_batch(const flash_write_segment *segments, uint32_t count) {
+    uint32_t start = now();
+    flash_error result = inner.write_batch(segments, count);
+    emit(TRACE_WRITE_BATCH, 0, result, segments ? segments[0].addr : 0, count, now() - start, NULL);
+    
+    for (uint32_t i = 0; segments && i < count; i++) {
+        emit(TRACE_WRITE, TRACE_EVENT_IN_BATCH, result, segments[i].addr, segments[i].len, 0, segments[i].ptr);
+    }
+    return result;
+}
+
+flash_error trace_hal_start(const trace_config *config) {
+    if (config == NULL) {return ERR_NULL_PTR;}
+    if (tracing) {return ERR_INVALID_ARGUMENT;}
+    
+    active = *config;
+    inner = g_flash_hal;
+    memset(&stats, 0, sizeof(stats));
+    
+    // only wrap what the HAL actually has so optional entries stay NULL
+    if (inner.init) {g_flash_hal.init = &traced_init;}
+    if (inner.deinit) {g_flash_hal.deinit = &traced_deinit;}
+    if (inner.write) {g_flash_hal.write = &traced_write;}
+    if (inner.read) {g_flash_hal.read = &traced_read;}
+    if (inner.erase) {g_flash_hal.erase = &traced_erase;}
+    if (inner.sync) {g_flash_hal.sync = &traced_sync;}
+    if (inner.write_batch) {g_flash_hal.write_batch = &traced_write_batch;}
+    
+    tracing = 1;
+    
+    if (active.sink) {
+        trace_file_header header = {0};
+        header.magic = TRACE_MAGIC;
+        header.version = TRACE_VERSION;
+        header.flash_align = FLASH_ALIGN;
+        header.sector_size = SECTOR_SIZE;
+        header.partition_size = PARTITION_SIZE;
+        active.sink(active.ctx, &header, sizeof(header));
+    }
+    
+    return ERR_SUCCESS;
+}
+
+void trace_hal_stop() {
+    if (!tracing) {return;}
+    g_flash_hal = inner;
+    tracing = 0;
+    // the stats stay readable until the next start
+    memset(&active, 0, sizeof(active));
+}
+
+const trace_stats *trace_hal_stats() {
+    return &stats;
+}
+
+void trace_hal_reset_stats() {
+    memset(&stats, 0, sizeof(stats));
+}
+
+void trace_file_sink(void *ctx, const void *bytes, uint32_t len) {
+    if (ctx == NULL) {return;}
+    fwrite(bytes, 1, len, (FILE*)ctx);
+}
+
+flash_error trace_flashlog_write(FlashlogState *state, const void *ptr, uint32_t size, flashlog_durability durability) {
+    uint32_t start = now();
+    flash_error result = flashlog_write_durable(state, ptr, size, durability);
+    emit(TRACE_LOG_WRITE, 0, result, durability, size, now() - start, ptr);
+    return result;
+}
+
+flash_error trace_read_latest(FlashlogState *state, void *ptr, uint32_t max_size) {
+    uint32_t start = now();
+    flash_error result = read_latest(state, ptr, max_size);
+    emit(TRACE_LOG_READ, 0, result, 0, max_size, now() - start, NULL);
+    return result;
+}
+
+flash_error trace_flashlog_flush(FlashlogState *state) {
+    uint32_t start = now();
+    flash_error result = flashlog_flush(state);
+    emit(TRACE_LOG_FLUSH, 0, result, 0, 0, now() - start, NULL);
+    return result;
+}
@@ -0,0 +1,82 @@
+#ifndef TRACE_HAL_H
+#define TRACE_HAL_H
+
+#include "../hal/flash_hal.h"
+#include "../core/flashlog.h"
+#include "stdint.h"
+
+// records every flash_hal_t call into a compact binary trace. trace_hal_start swaps the entries
+// of g_flash_hal for recording wrappers that forward to the real HAL, trace_hal_stop puts them
+// back. the trace_flashlog_* wrappers add logical events so a replay can run the same workload
+// through a differently configured log, see src/tools/flash_replay.c
+//
+// a trace is a trace_file_header followed by trace_events, each followed by len bytes of data
+// when it has TRACE_EVENT_HAS_DATA. everything is in host byte order
+
+#define TRACE_MAGIC 0x52544C46 // ascii FLTR
+#define TRACE_VERSION 1
+
+typedef enum {
+    TRACE_INIT,
+    TRACE_DEINIT,
+    TRACE_WRITE,        // addr, len
+    TRACE_READ,         // addr, len
+    TRACE_ERASE,        // addr is the sector
+    TRACE_SYNC,
+    TRACE_WRITE_BATCH,  // len is the segment count, the segments follow as TRACE_WRITE events
+    TRACE_LOG_WRITE,    // logical flashlog write, len is the payload size, addr the durability
+    TRACE_LOG_READ,     // logical read_latest, len is the caller's max size
+    TRACE_LOG_FLUSH,    // logical flashlog_flush
+    TRACE_OP_COUNT
+} trace_op;
+
+#define TRACE_EVENT_HAS_DATA 0x01
+#define TRACE_EVENT_IN_BATCH 0x02
+
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t flash_align;
+    uint32_t sector_size;
+    uint32_t partition_size;
+} trace_file_header;
+
+typedef struct {
+    uint8_t op;
+    uint8_t flags;
+    uint16_t result;    // flash_error the call returned
+    uint32_t addr;
+    uint32_t len;
+    uint32_t duration;  // in ticks of the configured clock, 0 without one
+} trace_event;
+
+typedef void (*trace_sink)(void *ctx, const void *bytes, uint32_t len);
+
+typedef struct {
+    trace_sink sink;        // can be NULL to only keep the counters
+    void *ctx;
+    uint32_t (*clock)();    // optional tick source for durations
+    int capture_data;       // also record the bytes written, and read back for TRACE_READ
+} trace_config;
+
+typedef struct {
+    uint32_t calls[TRACE_OP_COUNT];
+    uint64_t bytes[TRACE_OP_COUNT];
+    uint64_t ticks[TRACE_OP_COUNT];
+} trace_stats;
+
+// start clears the stats. after stop the sink isn't called again, so ctx can be closed
+flash_error trace_hal_start(const trace_config *config);
+void trace_hal_stop();
+
+const trace_stats *trace_hal_stats();
+void trace_hal_reset_stats();
+
+// sink that fwrites to the FILE * passed as ctx
+void trace_file_sink(void *ctx, const void *bytes, uint32_t len);
+
+flash_error trace_flashlog_write(FlashlogState *state, const void *ptr, uint32_t size, flashlog_durability durability);
+flash_error trace_read_latest(FlashlogState *state, void *ptr, uint32_t max_size);
+flash_error trace_flashlog_flush(FlashlogState *state);
+
+#endif